@@ -0,0 +1,489 @@
+// Micro-benchmarks for fastbpe-cpp internals.
+//
+// Build:
+//   g++ -std=c++17 -O3 -march=native -pthread eval/bench_bpe.cpp -o bin/bench_bpe
+//
+// Usage:
+//   ./bin/bench_bpe maps <corpus> [vocab_size]     pair map layouts / rank table: training + encode lookups
+//   ./bin/bench_bpe alloc <corpus> [vocab_size]    heap allocations per call: encode() vs encode_into()
+//   ./bin/bench_bpe fused <corpus> [vocab_size]    whole-input encode: lexical_split() + rebuild vs single pass
+//   ./bin/bench_bpe cache <corpus> [vocab_size]    segment cache: no cache vs LRU / CLOCK at several capacities
+//   ./bin/bench_bpe words <corpus> [vocab_size]    precomputed word table: cold encode of the first 64 KB
+//   ./bin/bench_bpe load <corpus> [vocab_size]     model load time: v1 (read + rebuild) vs v2 (mmap)
+//   ./bin/bench_bpe decode <corpus> [vocab_size]   bulk decode GB/s: per-token append vs pre-sized block copies
+//   ./bin/bench_bpe stream <corpus> [vocab_size]   token-at-a-time decode: decode({id}) vs StreamDecoder
+//   ./bin/bench_bpe lex <corpus>                   lexing MB/s: ctype calls vs class table vs SIMD masks
+//   ./bin/bench_bpe merge <corpus> [vocab_size]    training time with 1 / 2 / 4 threads (apply phase split out)
+
+#define BPE_NO_MAIN
+#include "../src/bpe.cpp"
+
+#include <new>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+
+// Allocation-counting hook: every global operator new in this binary bumps the counter.
+static std::atomic<size_t> g_allocations{0};
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+static const char* map_name(PairMapKind kind) {
+    return kind == PAIR_MAP_SWISS ? "swiss     " : "linear    ";
+}
+
+// Training statistics and encode lookups with each pair map layout.
+static void bench_maps(const std::string& text, uint32_t vocab_size) {
+    const PairMapKind kinds[] = {PAIR_MAP_LINEAR, PAIR_MAP_SWISS};
+
+    std::cout << "== train (" << text.size() / 1e6 << " MB, vocab " << vocab_size << ")\n";
+    for (PairMapKind kind : kinds) {
+        BPETokenizer tok;
+        tok.train_map_kind = kind;
+        const auto t0 = Clock::now();
+        tok.train(text, vocab_size, 2);
+        const double s = seconds(t0, Clock::now());
+        const auto& ps = tok.train_stats.map_probes;
+        std::cout << map_name(kind) << "  " << s * 1e3 << " ms"
+                  << "  avg probe " << ps.avg_probe << "  max probe " << ps.max_probe << "\n";
+    }
+
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+
+    // Lookup keys: adjacent bytes (mostly hits) and adjacent final tokens (mostly misses),
+    // the two ends of what byte_pair_encode_piece() asks for.
+    const std::vector<uint32_t> ids = tok.encode(text);
+    std::vector<std::pair<uint32_t, uint32_t>> keys;
+    keys.reserve(text.size() + ids.size());
+    for (size_t i = 0; i + 1 < text.size(); i++) {
+        keys.push_back({static_cast<unsigned char>(text[i]), static_cast<unsigned char>(text[i + 1])});
+    }
+    for (size_t i = 0; i + 1 < ids.size(); i++) {
+        keys.push_back({ids[i], ids[i + 1]});
+    }
+
+    std::cout << "== encode lookups (" << keys.size() / 1e6 << " M keys)\n";
+    for (int variant = 0; variant < 3; variant++) {
+        const PairMapKind kind = variant == 1 ? PAIR_MAP_SWISS : PAIR_MAP_LINEAR;
+        tok.inference_map_kind = kind;
+        tok.inference_lookup = variant == 2 ? LOOKUP_RANK_TABLE : LOOKUP_HASH;
+        tok.build_inference_map();
+
+        const auto t0 = Clock::now();
+        int64_t sum = 0;
+        for (const auto& k : keys) sum += tok.merge_rank(k.first, k.second);
+        const double lookup_s = seconds(t0, Clock::now());
+
+        const auto t1 = Clock::now();
+        const size_t tokens = tok.encode(text).size();
+        const double encode_s = seconds(t1, Clock::now());
+
+        std::cout << (variant == 2 ? "rank table" : map_name(kind)) << "  " << keys.size() / lookup_s / 1e6 << " M lookups/s"
+                  << "  encode " << text.size() / encode_s / 1e6 << " MB/s"
+                  << "  (" << tokens << " tokens, checksum " << sum << ")\n";
+    }
+}
+
+// Many small encode calls (one per line), as on a serving path. Each API gets a warm-up
+// pass first; the second pass is timed and its allocations counted.
+static void bench_alloc(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    tok.build_inference_map();
+
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < text.size();) {
+        size_t j = text.find('\n', i);
+        j = (j == std::string::npos) ? text.size() : j + 1;
+        lines.push_back(text.substr(i, j - i));
+        i = j;
+    }
+
+    std::cout << "== small encodes (" << lines.size() << " calls)\n";
+
+    size_t tokens = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = g_allocations.load();
+        const auto t0 = Clock::now();
+        tokens = 0;
+        for (const auto& line : lines) tokens += tok.encode(line).size();
+        const double s = seconds(t0, Clock::now());
+        if (pass == 1) {
+            std::cout << "encode()       " << lines.size() / s / 1e6 << " M calls/s  "
+                      << double(g_allocations.load() - before) / lines.size() << " allocs/call"
+                      << "  (" << tokens << " tokens)\n";
+        }
+    }
+
+    EncodeContext ctx;
+    std::vector<uint32_t> out(text.size());
+    for (int pass = 0; pass < 2; pass++) {
+        const size_t before = g_allocations.load();
+        const auto t0 = Clock::now();
+        tokens = 0;
+        for (const auto& line : lines) {
+            tokens += tok.encode_into(line.data(), line.size(), ctx, out.data(), out.size());
+        }
+        const double s = seconds(t0, Clock::now());
+        if (pass == 1) {
+            std::cout << "encode_into()  " << lines.size() / s / 1e6 << " M calls/s  "
+                      << double(g_allocations.load() - before) / lines.size() << " allocs/call"
+                      << "  (" << tokens << " tokens)\n";
+        }
+    }
+}
+
+// The pre-fusion encode(): materialize ids / next for the whole input, then walk them
+// again to rebuild each segment.
+static std::vector<uint32_t> encode_two_pass(BPETokenizer& tok, const std::string& text) {
+    std::vector<uint32_t> ids;
+    std::vector<int32_t> next_arr;
+    tok.lexical_split(text, ids, next_arr);
+
+    std::vector<uint32_t> result;
+    result.reserve(ids.size());
+    std::vector<uint32_t> segment;
+    for (size_t i = 0; i < ids.size(); i++) {
+        segment.push_back(ids[i]);
+        if (next_arr[i] == -1) {
+            auto encoded = tok.byte_pair_encode_piece(segment);
+            result.insert(result.end(), encoded.begin(), encoded.end());
+            segment.clear();
+        }
+    }
+    return result;
+}
+
+// Whole-input encode throughput, two-pass vs fused.
+static void bench_fused(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    tok.build_inference_map();
+
+    std::cout << "== encode (" << text.size() / 1e6 << " MB)\n";
+    for (int variant = 0; variant < 2; variant++) {
+        const size_t before = g_allocations.load();
+        const auto t0 = Clock::now();
+        const std::vector<uint32_t> ids = variant == 0 ? encode_two_pass(tok, text) : tok.encode(text);
+        const double s = seconds(t0, Clock::now());
+        std::cout << (variant == 0 ? "two-pass  " : "fused     ") << "  " << text.size() / s / 1e6 << " MB/s  "
+                  << g_allocations.load() - before << " allocs  (" << ids.size() << " tokens)\n";
+    }
+}
+
+// Encode throughput with the segment cache off, then LRU and CLOCK at a few capacities.
+// Each configuration starts cold and encodes the whole corpus once.
+static void bench_cache(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    tok.build_inference_map();
+    const std::vector<uint32_t> reference = tok.encode(text);
+
+    std::cout << "== segment cache (" << text.size() / 1e6 << " MB)\n";
+    const size_t capacities[] = {0, 1024, 16384, 65536};
+    const CachePolicy policies[] = {CACHE_LRU, CACHE_CLOCK};
+    for (size_t capacity : capacities) {
+        for (CachePolicy policy : policies) {
+            if (capacity == 0 && policy == CACHE_CLOCK) continue;
+            tok.encode_ctx.cache.configure(capacity, policy);
+
+            const auto t0 = Clock::now();
+            const std::vector<uint32_t> ids = tok.encode(text);
+            const double s = seconds(t0, Clock::now());
+
+            const SegmentCache& cache = tok.encode_ctx.cache;
+            const double lookups = double(cache.hits + cache.misses);
+            std::cout << (capacity == 0 ? "off  " : policy == CACHE_LRU ? "lru  " : "clock") << "  "
+                      << capacity << "  " << text.size() / s / 1e6 << " MB/s"
+                      << "  hit rate " << (lookups > 0 ? cache.hits / lookups : 0.0)
+                      << "  evictions " << cache.evictions
+                      << (ids == reference ? "" : "  MISMATCH") << "\n";
+        }
+    }
+}
+
+// Cold-start latency: a fresh context encodes the first 64 KB of the corpus, with the
+// word table built from the full corpus at several sizes (0 = merge loop only).
+static void bench_words(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    tok.build_inference_map();
+    const std::string head = text.substr(0, 64 << 10);
+    const std::vector<uint32_t> reference = tok.encode(head);
+
+    std::cout << "== word table, cold encode of " << head.size() / 1024 << " KB\n";
+    const size_t sizes[] = {0, 1000, 10000, 100000};
+    for (size_t top_n : sizes) {
+        const auto t0 = Clock::now();
+        tok.build_word_table(text.data(), text.size(), top_n);
+        const double build_s = seconds(t0, Clock::now());
+
+        EncodeContext ctx;
+        std::vector<uint32_t> out(head.size());
+        const auto t1 = Clock::now();
+        out.resize(tok.encode_into(head.data(), head.size(), ctx, out.data(), out.size()));
+        const double s = seconds(t1, Clock::now());
+
+        std::cout << "top " << top_n << " (" << tok.word_table.size() << " words, built in " << build_s * 1e3 << " ms)  "
+                  << s * 1e3 << " ms  " << head.size() / s / 1e6 << " MB/s"
+                  << (out == reference ? "" : "  MISMATCH") << "\n";
+    }
+}
+
+// Load time of the same model saved as v1 and v2 (files under /tmp), averaged over 20 loads.
+static void bench_load(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    const std::string paths[] = {"/tmp/bench_bpe_v1.bin", "/tmp/bench_bpe_v2.bin"};
+    tok.save(paths[0], BPE_VERSION);
+    tok.save(paths[1], BPE_VERSION_MAPPED);
+    const std::vector<uint32_t> reference = tok.encode(text.substr(0, 1 << 16));
+
+    std::cout << "== load (vocab " << vocab_size << ")\n";
+    for (int v = 0; v < 2; v++) {
+        const int rounds = 20;
+        const auto t0 = Clock::now();
+        BPETokenizer loaded;
+        for (int k = 0; k < rounds; k++) loaded.load(paths[v]);
+        const double s = seconds(t0, Clock::now()) / rounds;
+        std::cout << "v" << v + 1 << "  " << s * 1e3 << " ms per load"
+                  << (loaded.encode(text.substr(0, 1 << 16)) == reference ? "" : "  MISMATCH") << "\n";
+        std::remove(paths[v].c_str());
+    }
+}
+
+// Bulk decode of the whole encoded corpus: the previous append loop (reserve(ids.size()),
+// one append per token) against decode().
+static void bench_decode(const std::string& text, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(text, vocab_size, 2);
+    const std::vector<uint32_t> ids = tok.encode(text);
+    const int rounds = 20;
+
+    std::cout << "== decode (" << ids.size() << " tokens -> " << text.size() / 1e6 << " MB)\n";
+    for (int variant = 0; variant < 2; variant++) {
+        std::string out;
+        const auto t0 = Clock::now();
+        for (int k = 0; k < rounds; k++) {
+            if (variant == 0) {
+                out.clear();
+                out.shrink_to_fit();
+                out.reserve(ids.size());
+                for (uint32_t id : ids) out.append(tok.vocab[id]);
+            } else {
+                out = tok.decode(ids);
+            }
+        }
+        const double s = seconds(t0, Clock::now()) / rounds;
+        std::cout << (variant == 0 ? "append    " : "decode()  ") << "  " << text.size() / s / 1e9 << " GB/s"
+                  << (out == text ? "" : "  MISMATCH") << "\n";
+    }
+}
+
+// True if `s` does not end inside a UTF-8 sequence (stray bytes count as complete).
+static bool ends_on_sequence(std::string_view s) {
+    for (size_t k = 1; k <= std::min<size_t>(s.size(), 4); k++) {
+        const unsigned char c = static_cast<unsigned char>(s[s.size() - k]);
+        if ((c & 0xC0) == 0x80) continue;
+        const size_t need = (c >= 0xF0 && c < 0xF8) ? 4 : (c >= 0xE0 && c < 0xF0) ? 3 : (c >= 0xC0 && c < 0xE0) ? 2 : 1;
+        return need <= k;
+    }
+    return true;
+}
+
+// Per-token decode latency as in a generation loop. The corpus gets multi-byte UTF-8
+// characters mixed in, so sequences really do straddle tokens.
+static void bench_stream(const std::string& corpus, uint32_t vocab_size) {
+    BPETokenizer tok;
+    tok.train(corpus, vocab_size, 2);
+
+    std::string text;
+    for (char c : corpus) {
+        if (c == 'e') text += "\xC3\xA9";                               // é
+        else if (c == '!') text += "\xF0\x9F\x99\x82";                // 4-byte emoji
+        else text += c;
+    }
+    const std::vector<uint32_t> ids = tok.encode(text);
+
+    std::cout << "== stream decode (" << ids.size() << " tokens)\n";
+    for (int variant = 0; variant < 2; variant++) {
+        std::string joined;
+        joined.reserve(text.size());
+        bool complete = true;
+        StreamDecoder stream(tok.vocab);
+
+        const size_t before = g_allocations.load();
+        const auto t0 = Clock::now();
+        size_t bytes = 0;
+        for (uint32_t id : ids) {
+            if (variant == 0) {
+                const std::string piece = tok.decode(&id, 1);
+                bytes += piece.size();
+            } else {
+                const std::string_view piece = stream.push(id);
+                bytes += piece.size();
+            }
+        }
+        const double s = seconds(t0, Clock::now());
+        const double allocs = double(g_allocations.load() - before) / ids.size();
+
+        if (variant == 1) {                                             // Separate pass: check every chunk
+            stream.reset();
+            for (uint32_t id : ids) {
+                const std::string_view piece = stream.push(id);
+                complete = complete && ends_on_sequence(piece);
+                joined.append(piece);
+            }
+            joined.append(stream.flush());
+        }
+        std::cout << (variant == 0 ? "decode({id})   " : "StreamDecoder  ") << s / ids.size() * 1e9 << " ns/token  "
+                  << allocs << " allocs/token  (" << bytes << " bytes)"
+                  << (variant == 1 && (joined != text || !complete) ? "  MISMATCH" : "") << "\n";
+    }
+}
+
+// The lexer before the class table: three locale-dependent ctype calls per byte.
+static uint8_t ctype_class(unsigned char c) {
+    if (std::isspace(c)) return CLASS_SPACE;
+    if (std::isalpha(c)) return CLASS_ALPHA;
+    if (std::isdigit(c)) return CLASS_DIGIT;
+    return CLASS_OTHER;
+}
+
+static size_t ctype_segment_end(const char* text, size_t i, size_t n) {
+    const uint8_t cls = ctype_class(static_cast<unsigned char>(text[i]));
+    i++;
+    if (cls == CLASS_OTHER) return i;
+    while (i < n && ctype_class(static_cast<unsigned char>(text[i])) == cls) i++;
+    return i;
+}
+
+// Lexing throughput over a file of any size: each lexer streams the whole file once in
+// 64 MB chunks; only time spent lexing is counted.
+static void bench_lex(const std::string& path) {
+    for (int c = 0; c < 256; c++) {
+        if (ctype_class(static_cast<unsigned char>(c)) != byte_class(static_cast<unsigned char>(c))) {
+            std::cout << "class table differs from ctype at byte " << c << "\n";
+        }
+    }
+
+    static const char* names[] = {"ctype calls ", "class table ", "SIMD masks  "};
+    for (int variant = 0; variant < 3; variant++) {
+        double s = 0;
+        size_t bytes = 0, segments = 0;
+        for_each_chunk(path, size_t(64) << 20, [&](const char* data, size_t len) {
+            const auto t0 = Clock::now();
+            if (variant == 2) {
+                for_each_segment(data, len, [&](size_t, size_t) { segments++; });
+            } else {
+                for (size_t i = 0; i < len; segments++) {
+                    i = variant == 0 ? ctype_segment_end(data, i, len) : segment_end(data, i, len);
+                }
+            }
+            s += seconds(t0, Clock::now());
+            bytes += len;
+        });
+        std::cout << names[variant] << "  " << bytes / s / 1e6 << " MB/s"
+                  << "  (" << segments << " segments in " << bytes / 1e6 << " MB)\n";
+    }
+
+    // lexical_split(): per-byte push_back, bulk val / next fill, and (offset, length) spans
+    std::string text;
+    for_each_chunk(path, size_t(64) << 20, [&](const char* data, size_t len) {
+        if (text.size() < (size_t(64) << 20)) text.append(data, std::min(len, (size_t(64) << 20) - text.size()));
+    });
+    for (int variant = 0; variant < 3; variant++) {
+        std::vector<uint32_t> val;
+        std::vector<int32_t> next;
+        std::vector<SegmentSpan> spans;
+        const auto t0 = Clock::now();
+        if (variant == 2) {
+            BPETokenizer tok;
+            tok.lexical_split(text, spans);
+        } else if (variant == 0) {
+            for (size_t i = 0; i < text.size();) {
+                const size_t start = i;
+                i = segment_end(text.data(), i, text.size());
+                for (size_t k = start; k < i; k++) {
+                    val.push_back(static_cast<unsigned char>(text[k]));
+                    next.push_back(k + 1 < i ? static_cast<int32_t>(k + 1) : -1);
+                }
+            }
+        } else {
+            BPETokenizer tok;
+            tok.lexical_split(text, val, next);
+        }
+        const double s = seconds(t0, Clock::now());
+        static const char* splits[] = {"split, per byte ", "split, bulk     ", "split, spans    "};
+        const size_t out_bytes = val.size() * sizeof(uint32_t) + next.size() * sizeof(int32_t) +
+                                 spans.size() * sizeof(SegmentSpan);
+        std::cout << splits[variant] << text.size() / s / 1e6 << " MB/s  "
+                  << double(out_bytes) / text.size() << " output bytes per input byte\n";
+    }
+}
+
+// Training time with parallel merge application: total and apply phase per thread count,
+// and whether the model matches the single-threaded one.
+static void bench_merge(const std::string& text, uint32_t vocab_size) {
+    std::vector<BPETokenizer::MergeRule> serial;
+    for (uint32_t threads : {1u, 2u, 4u}) {
+        BPETokenizer tok;
+        tok.train_threads = threads;
+        const auto t0 = Clock::now();
+        tok.train(text, vocab_size, 2);
+        const double s = seconds(t0, Clock::now());
+        if (threads == 1) serial = tok.merges;
+
+        const bool same = tok.merges.size() == serial.size() &&
+                          std::equal(serial.begin(), serial.end(), tok.merges.begin(), [](const auto& x, const auto& y) {
+                              return x.a == y.a && x.b == y.b && x.new_id == y.new_id;
+                          });
+        std::cout << threads << " thread(s)  " << s * 1e3 << " ms  apply " << tok.train_stats.apply_seconds * 1e3
+                  << " ms" << (same ? "" : "  MISMATCH") << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: bench_bpe <maps|alloc|fused|cache|words|load|decode|stream|lex|merge> <corpus> [vocab_size]\n";
+        return 1;
+    }
+
+    const std::string section = argv[1];
+    if (section == "lex") {                                 // Streams the file itself
+        bench_lex(argv[2]);
+        return 0;
+    }
+    const std::string text = read_file(argv[2]);
+
+    if (section == "maps") {
+        bench_maps(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "alloc") {
+        bench_alloc(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "fused") {
+        bench_fused(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "cache") {
+        bench_cache(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "words") {
+        bench_words(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "load") {
+        bench_load(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "decode") {
+        bench_decode(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "stream") {
+        bench_stream(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else if (section == "merge") {
+        bench_merge(text, argc > 3 ? std::stoi(argv[3]) : 5000);
+    } else {
+        std::cerr << "unknown benchmark: " << section << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -119,5 +119,245 @@ if [[ "$IDS1" != "$IDS2" ]]; then
 fi
 echo "✓ Reload determinism OK"
 
+# 10. Streaming training
+echo "[10] Streaming training test..."
+
+$BPE train "$CORPUS" $TMP/stream_a.bin 1000 2 --stream --chunk-mb 1 > /dev/null
+$BPE train "$CORPUS" $TMP/stream_b.bin 1000 2 --stream > /dev/null
+
+if ! cmp -s $TMP/stream_a.bin $TMP/stream_b.bin; then
+    echo "✗ Streaming training depends on chunk size"
+    exit 1
+fi
+
+TEXT="To be, or not to be: that is the question."
+IDS=$($BPE encode $TMP/stream_a.bin "$TEXT")
+OUT=$($BPE decode $TMP/stream_a.bin $IDS)
+
+if [[ "$OUT" != "$TEXT" ]]; then
+    echo "✗ Streaming model round-trip failed"
+    exit 1
+fi
+echo "✓ Streaming training OK"
+
+# 11. Deduplicated in-memory training matches streaming training
+echo "[11] Dedup training test..."
+
+$BPE train "$CORPUS" $TMP/dedup.bin 1000 2 --dedup > /dev/null
+
+if ! cmp -s $TMP/dedup.bin $TMP/stream_a.bin; then
+    echo "✗ Dedup training differs from streaming training"
+    exit 1
+fi
+echo "✓ Dedup training OK"
+
+# 12. Multi-threaded pair counting is bit-identical
+echo "[12] Multi-threaded training test..."
+
+$BPE train "$CORPUS" $TMP/threads.bin 5000 1 --threads 4 > /dev/null
+
+if ! cmp -s $TMP/threads.bin "$MODEL"; then
+    echo "✗ Multi-threaded training differs from single-threaded"
+    exit 1
+fi
+echo "✓ Multi-threaded training OK"
+
+# 13. Long pieces (heap encoder) round-trip
+echo "[13] Long piece test..."
+
+LONG=$(printf 'therethere%.0s' {1..200})
+IDS=$($BPE encode "$MODEL" "$LONG")
+OUT=$($BPE decode "$MODEL" $IDS)
+
+if [[ "$OUT" != "$LONG" ]]; then
+    echo "✗ Long piece round-trip failed"
+    exit 1
+fi
+echo "✓ Long piece OK"
+
+# 14. Batch encode matches per-document encode
+echo "[14] Batch encode test..."
+
+head -n 200 "$CORPUS" > $TMP/docs.txt
+$BPE encode-batch "$MODEL" $TMP/docs.txt --threads 4 > $TMP/batch.txt
+
+LINE=0
+while IFS= read -r DOC; do
+    LINE=$((LINE + 1))
+    EXPECTED=$($BPE encode "$MODEL" "$DOC")
+    GOT=$(sed -n "${LINE}p" $TMP/batch.txt)
+    if [[ "$(echo $GOT)" != "$(echo $EXPECTED)" ]]; then
+        echo "✗ Batch encode differs from encode on line $LINE"
+        exit 1
+    fi
+done < <(head -n 20 $TMP/docs.txt)
+
+if [[ $(wc -l < $TMP/batch.txt) -ne 200 ]]; then
+    echo "✗ Batch encode produced the wrong number of documents"
+    exit 1
+fi
+echo "✓ Batch encode OK"
+
+# 15. Parallel encode of one document is identical to serial encode
+echo "[15] Parallel encode test..."
+
+DOC=$(head -c 100000 "$CORPUS")
+SERIAL=$($BPE encode "$MODEL" "$DOC")
+PARALLEL=$($BPE encode "$MODEL" "$DOC" --threads 4)
+
+if [[ "$SERIAL" != "$PARALLEL" ]]; then
+    echo "✗ Parallel encode differs from serial encode"
+    exit 1
+fi
+echo "✓ Parallel encode OK"
+
+# 16. File encode writes the same IDs as encode
+echo "[16] File encode test..."
+
+head -c 50000 "$CORPUS" > $TMP/file_in.txt
+$BPE encode-file "$MODEL" $TMP/file_in.txt $TMP/file_u32.bin --u32 --chunk-mb 1 > /dev/null
+$BPE encode-file "$MODEL" $TMP/file_in.txt $TMP/file_u16.bin --u16 > /dev/null
+
+EXPECTED=$($BPE encode "$MODEL" "$(cat $TMP/file_in.txt)")
+GOT32=$(od -An -v -tu4 $TMP/file_u32.bin)
+GOT16=$(od -An -v -tu2 $TMP/file_u16.bin)
+
+if [[ "$(echo $GOT32)" != "$(echo $EXPECTED)" || "$(echo $GOT16)" != "$(echo $EXPECTED)" ]]; then
+    echo "✗ File encode differs from encode"
+    exit 1
+fi
+echo "✓ File encode OK"
+
+# 17. Memory-mappable v2 model format
+echo "[17] Model format v2 test..."
+
+$BPE convert "$MODEL" $TMP/model_v2.bin --format 2 > /dev/null
+$BPE convert $TMP/model_v2.bin $TMP/model_v1.bin --format 1 > /dev/null
+
+if ! cmp -s $TMP/model_v1.bin "$MODEL"; then
+    echo "✗ v1 -> v2 -> v1 conversion is not lossless"
+    exit 1
+fi
+
+TEXT="To be, or not to be: that is the question."
+if [[ "$($BPE encode $TMP/model_v2.bin "$TEXT")" != "$($BPE encode "$MODEL" "$TEXT")" ]]; then
+    echo "✗ v2 model encodes differently"
+    exit 1
+fi
+OUT=$($BPE decode $TMP/model_v2.bin $($BPE encode $TMP/model_v2.bin "$TEXT"))
+if [[ "$OUT" != "$TEXT" ]]; then
+    echo "✗ v2 model round-trip failed"
+    exit 1
+fi
+
+# Saving over the mapped model itself (v2 -> v2, v2 -> v1) must not damage it
+cp $TMP/model_v2.bin $TMP/model_self.bin
+$BPE convert $TMP/model_self.bin $TMP/model_self.bin --format 2 > /dev/null
+if ! cmp -s $TMP/model_self.bin $TMP/model_v2.bin; then
+    echo "✗ v2 model saved over itself is damaged"
+    exit 1
+fi
+$BPE convert $TMP/model_self.bin $TMP/model_self.bin --format 1 > /dev/null
+if ! cmp -s $TMP/model_self.bin "$MODEL"; then
+    echo "✗ v2 model converted to v1 over itself is damaged"
+    exit 1
+fi
+echo "✓ Model format v2 OK"
+
+# 18. Indexed heap: dedup and full-stream training learn the same merges
+echo "[18] Indexed heap training test..."
+
+$BPE train "$CORPUS" $TMP/heap.bin 5000 1 --indexed-heap > /dev/null
+$BPE train "$CORPUS" $TMP/heap_dedup.bin 5000 1 --dedup --indexed-heap > /dev/null
+
+if ! cmp -s $TMP/heap.bin $TMP/heap_dedup.bin; then
+    echo "✗ --indexed-heap differs between full and dedup training"
+    exit 1
+fi
+echo "✓ Indexed heap training OK"
+
+# 19. IndexPool compaction does not change the learned merges
+echo "[19] IndexPool compaction test..."
+
+$BPE train "$CORPUS" $TMP/compact.bin 5000 1 --compact-ratio 2 > /dev/null
+
+if ! cmp -s $TMP/compact.bin "$MODEL"; then
+    echo "✗ --compact-ratio 2 differs from training without compaction"
+    exit 1
+fi
+echo "✓ IndexPool compaction OK"
+
+# 20. Swiss-table pair statistics learn the same merges
+echo "[20] Swiss pair map training test..."
+
+$BPE train "$CORPUS" $TMP/swiss.bin 5000 1 --swiss > /dev/null
+
+if ! cmp -s $TMP/swiss.bin "$MODEL"; then
+    echo "✗ --swiss differs from the linear-probing pair map"
+    exit 1
+fi
+echo "✓ Swiss pair map training OK"
+
+# 21. Word table stored in a v2 model: same IDs as encoding without it
+echo "[21] Word table test..."
+
+$BPE train "$CORPUS" $TMP/words_v2.bin 5000 1 --word-table 2000 --format 2 > /dev/null
+$BPE convert "$MODEL" $TMP/nowords_v2.bin --format 2 > /dev/null
+
+if [[ $(wc -c < $TMP/words_v2.bin) -le $(wc -c < $TMP/nowords_v2.bin) ]]; then
+    echo "✗ Word table was not stored in the v2 model"
+    exit 1
+fi
+
+$BPE encode-file $TMP/words_v2.bin "$CORPUS" $TMP/with_words.ids --u32 > /dev/null
+$BPE encode-file $TMP/nowords_v2.bin "$CORPUS" $TMP/without_words.ids --u32 > /dev/null
+if ! cmp -s $TMP/with_words.ids $TMP/without_words.ids; then
+    echo "✗ Encoding with the word table differs from encoding without it"
+    exit 1
+fi
+echo "✓ Word table OK"
+
+# 22. Corrupt rank table in a v2 model is rejected at load
+echo "[22] Corrupt v2 rank table detection..."
+
+$BPE train "$CORPUS" $TMP/small_v2.bin 1000 1 --format 2 > /dev/null
+RANKS_AT=$(od -An -t u8 -j 56 -N 8 $TMP/small_v2.bin | tr -d ' ')
+printf '\360\377\377\177' | dd of=$TMP/small_v2.bin bs=1 seek=$RANKS_AT conv=notrunc 2> /dev/null
+
+if $BPE encode $TMP/small_v2.bin "hello there" > /dev/null 2>&1; then
+    echo "✗ Out-of-range rank in a v2 model was not detected"
+    exit 1
+fi
+
+$BPE train "$CORPUS" $TMP/small_v2.bin 1000 1 --format 2 > /dev/null
+printf '\000\000\000\000\000\000\000\200' | dd of=$TMP/small_v2.bin bs=1 seek=48 conv=notrunc 2> /dev/null
+
+ERR=$($BPE encode $TMP/small_v2.bin "hello there" 2>&1 || true)
+if [[ "$ERR" != *"bad rank table size"* ]]; then
+    echo "✗ Oversized rank table entry count in a v2 model was not detected"
+    exit 1
+fi
+echo "✓ Corrupt v2 rank table detected"
+
+echo "[23] Corrupt merge rule detection..."
+
+cp $MODEL $TMP/bad_merge.bin
+printf '\240\206\001\000' | dd of=$TMP/bad_merge.bin bs=1 seek=16 conv=notrunc 2> /dev/null    # merges[0].a = 100000
+ERR=$($BPE encode $TMP/bad_merge.bin "the other thing then" 2>&1 || true)
+if [[ "$ERR" != *"bad merge rule"* ]]; then
+    echo "✗ Out-of-range merge token in a v1 model was not detected"
+    exit 1
+fi
+
+$BPE train "$CORPUS" $TMP/bad_merge_v2.bin 1000 1 --format 2 > /dev/null
+MERGES_AT=$(od -An -t u8 -j 16 -N 8 $TMP/bad_merge_v2.bin | tr -d ' ')
+printf '\377\377\377\377' | dd of=$TMP/bad_merge_v2.bin bs=1 seek=$((MERGES_AT + 8)) conv=notrunc 2> /dev/null    # merges[0].new_id
+ERR=$($BPE encode $TMP/bad_merge_v2.bin "the other thing then" 2>&1 || true)
+if [[ "$ERR" != *"bad merge rule"* ]]; then
+    echo "✗ Out-of-range merge result in a v2 model was not detected"
+    exit 1
+fi
+echo "✓ Corrupt merge rules detected"
+
 echo "ALL TESTS PASSED"
 echo "----------------"
@@ -1,7 +1,12 @@
+#include <array>
 #include <queue>
+#include <mutex>
+#include <chrono>
 #include <cstdio>
 #include <limits>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cstdint>
 #include <cassert>
@@ -9,9 +14,23 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 const uint32_t BPE_MAGIC = 0x42504521;      // "BPE! in little endian format"
 const uint32_t BPE_VERSION = 1;
+const uint32_t BPE_VERSION_MAPPED = 2;      // Memory-mappable layout, see ModelHeaderV2
 
 inline uint64_t pack(uint32_t a, uint32_t b) {
     return (uint64_t(a) << 32) | b;
@@ -21,6 +40,274 @@ inline std::pair<uint32_t, uint32_t> unpack(uint64_t key) {
     return {uint32_t(key >> 32), uint32_t(key & 0xFFFFFFFF)};
 }
 
+// Pair counts are 32-bit; weighted (deduplicated) counts saturate instead of wrapping.
+inline uint32_t add_count(uint32_t count, uint32_t delta) {
+    return count > UINT32_MAX - delta ? UINT32_MAX : count + delta;
+}
+
+// Byte classes used by the lexer. A segment is a maximal run of SPACE, ALPHA or DIGIT
+// bytes, or a single OTHER byte.
+enum ByteClass : uint8_t { CLASS_SPACE, CLASS_ALPHA, CLASS_DIGIT, CLASS_OTHER };
+
+// Class of every byte value, exactly as the "C" locale's isspace / isalpha / isdigit
+// classify it (bytes >= 0x80 are OTHER). One load instead of three library calls.
+constexpr std::array<uint8_t, 256> make_byte_classes() {
+    std::array<uint8_t, 256> classes{};
+    for (int c = 0; c < 256; c++) {
+        if (c == ' ' || (c >= '\t' && c <= '\r'))                  classes[c] = CLASS_SPACE;
+        else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))  classes[c] = CLASS_ALPHA;
+        else if (c >= '0' && c <= '9')                              classes[c] = CLASS_DIGIT;
+        else                                                        classes[c] = CLASS_OTHER;
+    }
+    return classes;
+}
+inline constexpr std::array<uint8_t, 256> BYTE_CLASSES = make_byte_classes();
+
+inline uint8_t byte_class(unsigned char c) {
+    return BYTE_CLASSES[c];
+}
+
+// Lexer state machine. The state is the class of the segment being read; a byte of class
+// `cls` extends it iff LEX_CONTINUES[state][cls], otherwise a new segment starts there.
+// OTHER never continues, so punctuation / other bytes are single-byte segments.
+// segment_end() and last_segment_start() run this machine byte by byte;
+// for_each_segment() evaluates the same machine 64 bytes at a time with class bitmasks
+// (static_asserts there keep both in sync), so training, encoding and chunked reading
+// all agree on where segments start.
+inline constexpr uint8_t LEX_CONTINUES[4][4] = {
+    //          SPACE ALPHA DIGIT OTHER
+    /* SPACE */ {1,    0,    0,    0},
+    /* ALPHA */ {0,    1,    0,    0},
+    /* DIGIT */ {0,    0,    1,    0},
+    /* OTHER */ {0,    0,    0,    0},
+};
+
+// End (exclusive) of the segment starting at text[i].
+inline size_t segment_end(const char* text, size_t i, size_t n) {
+    const uint8_t state = BYTE_CLASSES[static_cast<unsigned char>(text[i])];
+    const uint8_t* continues = LEX_CONTINUES[state];
+    i++;
+    while (i < n && continues[BYTE_CLASSES[static_cast<unsigned char>(text[i])]]) {
+        i++;
+    }
+    return i;
+}
+
+// Start of the trailing segment of text[0, n). Cutting a buffer here never splits a
+// segment, so everything before the cut lexes exactly as it would in the full input.
+inline size_t last_segment_start(const char* text, size_t n) {
+    if (n == 0) return 0;
+    const uint8_t* continues = LEX_CONTINUES[BYTE_CLASSES[static_cast<unsigned char>(text[n - 1])]];
+    size_t i = n - 1;
+    while (i > 0 && continues[BYTE_CLASSES[static_cast<unsigned char>(text[i - 1])]]) {
+        i--;
+    }
+    return i;
+}
+
+// Class bitmasks of a block of up to 64 bytes: bit k of space / alpha / digit is set when
+// p[k] has that class (OTHER = none of them). Full blocks are classified 32 (AVX2) or 16
+// (SSE2) bytes at a time with range compares; short tails use BYTE_CLASSES.
+
+// The byte ranges the SIMD compares test, which must reproduce BYTE_CLASSES.
+constexpr uint8_t range_byte_class(int c) {
+    if (c == ' ' || (c >= '\t' && c <= '\r')) return CLASS_SPACE;
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') return CLASS_ALPHA;
+    if (c >= '0' && c <= '9') return CLASS_DIGIT;
+    return CLASS_OTHER;
+}
+
+constexpr bool range_classes_match_table() {
+    for (int c = 0; c < 256; c++) {
+        if (range_byte_class(c) != BYTE_CLASSES[c]) return false;
+    }
+    return true;
+}
+
+// The bitmask scan assumes a segment is a run of one class other than OTHER.
+constexpr bool lex_continues_is_same_class() {
+    for (int state = 0; state < 4; state++) {
+        for (int cls = 0; cls < 4; cls++) {
+            if (LEX_CONTINUES[state][cls] != (state == cls && state != CLASS_OTHER)) return false;
+        }
+    }
+    return true;
+}
+
+static_assert(range_classes_match_table(), "SIMD class ranges out of sync with BYTE_CLASSES");
+static_assert(lex_continues_is_same_class(), "for_each_segment() assumes same-class runs (LEX_CONTINUES)");
+
+struct ClassMasks {
+    uint64_t space;
+    uint64_t alpha;
+    uint64_t digit;
+};
+
+#if defined(__AVX2__)
+inline __m256i in_range_256(__m256i c, char lo, char hi) {      // lo <= c <= hi, unsigned
+    const __m256i t = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(static_cast<char>(hi - lo))), t);
+}
+
+inline ClassMasks classify_32(const char* p) {
+    const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), in_range_256(c, '\t', '\r'));
+    const __m256i alpha = in_range_256(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z');
+    const __m256i digit = in_range_256(c, '0', '9');
+    return {static_cast<uint32_t>(_mm256_movemask_epi8(space)),
+            static_cast<uint32_t>(_mm256_movemask_epi8(alpha)),
+            static_cast<uint32_t>(_mm256_movemask_epi8(digit))};
+}
+#elif defined(__SSE2__)
+inline __m128i in_range_128(__m128i c, char lo, char hi) {      // lo <= c <= hi, unsigned
+    const __m128i t = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(static_cast<char>(hi - lo))), t);
+}
+
+inline ClassMasks classify_16(const char* p) {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), in_range_128(c, '\t', '\r'));
+    const __m128i alpha = in_range_128(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z');
+    const __m128i digit = in_range_128(c, '0', '9');
+    return {static_cast<uint32_t>(_mm_movemask_epi8(space)),
+            static_cast<uint32_t>(_mm_movemask_epi8(alpha)),
+            static_cast<uint32_t>(_mm_movemask_epi8(digit))};
+}
+#endif
+
+inline ClassMasks classify_block(const char* p, size_t len) {
+    ClassMasks m = {0, 0, 0};
+    size_t k = 0;
+#if defined(__AVX2__)
+    for (; k + 32 <= len; k += 32) {
+        const ClassMasks part = classify_32(p + k);
+        m.space |= part.space << k;
+        m.alpha |= part.alpha << k;
+        m.digit |= part.digit << k;
+    }
+#elif defined(__SSE2__)
+    for (; k + 16 <= len; k += 16) {
+        const ClassMasks part = classify_16(p + k);
+        m.space |= part.space << k;
+        m.alpha |= part.alpha << k;
+        m.digit |= part.digit << k;
+    }
+#endif
+    for (; k < len; k++) {
+        const uint8_t cls = BYTE_CLASSES[static_cast<unsigned char>(p[k])];
+        m.space |= uint64_t(cls == CLASS_SPACE) << k;
+        m.alpha |= uint64_t(cls == CLASS_ALPHA) << k;
+        m.digit |= uint64_t(cls == CLASS_DIGIT) << k;
+    }
+    return m;
+}
+
+// Calls fn(start, end) for every segment of text[0, n), in order; same segments as
+// repeated segment_end(). Works 64 bytes at a time: a byte continues the segment before it
+// iff both have the same SPACE / ALPHA / DIGIT class (LEX_CONTINUES), so the segment starts
+// of a block are ~(space & (space << 1) | alpha & ... | digit & ...), with the carry bits
+// taken from the last byte of the previous block. Starts are then popped with ctz.
+template <class Fn>
+void for_each_segment(const char* text, size_t n, Fn&& fn) {
+    size_t start = 0;
+    uint64_t carry_space = 0, carry_alpha = 0, carry_digit = 0;     // Class of the byte before the block
+
+    for (size_t base = 0; base < n; base += 64) {
+        const size_t len = std::min<size_t>(64, n - base);
+        const ClassMasks m = classify_block(text + base, len);
+
+        const uint64_t same = (m.space & ((m.space << 1) | carry_space)) |
+                              (m.alpha & ((m.alpha << 1) | carry_alpha)) |
+                              (m.digit & ((m.digit << 1) | carry_digit));
+        const uint64_t valid = len == 64 ? ~uint64_t(0) : (uint64_t(1) << len) - 1;
+        uint64_t starts = ~same & valid;
+        if (base == 0) starts &= ~uint64_t(1);                      // The first segment starts at 0
+
+        while (starts) {
+            const size_t end = base + static_cast<size_t>(__builtin_ctzll(starts));
+            fn(start, end);
+            start = end;
+            starts &= starts - 1;
+        }
+
+        carry_space = (m.space >> (len - 1)) & 1;
+        carry_alpha = (m.alpha >> (len - 1)) & 1;
+        carry_digit = (m.digit >> (len - 1)) & 1;
+    }
+    if (n > 0) fn(start, n);
+}
+
+// Compact lexer output: one (offset, length) span per segment instead of a val / next
+// entry per byte. Offsets are relative to the lexed text.
+struct SegmentSpan {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// Writes the segments of text[0, n) to out (room for n spans suffices) and returns how
+// many there are.
+inline size_t lex_spans(const char* text, size_t n, SegmentSpan* out) {
+    if (n > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Input too large for segment spans");
+    }
+    size_t count = 0;
+    for_each_segment(text, n, [&](size_t start, size_t end) {
+        out[count++] = {static_cast<uint32_t>(start), static_cast<uint32_t>(end - start)};
+    });
+    return count;
+}
+
+// Appends the segments of text[0, n) to `spans`.
+inline void lex_spans(const char* text, size_t n, std::vector<SegmentSpan>& spans) {
+    if (n > std::numeric_limits<uint32_t>::max()) {
+        throw std::runtime_error("Input too large for segment spans");
+    }
+    for_each_segment(text, n, [&](size_t start, size_t end) {
+        spans.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(end - start)});
+    });
+}
+
+// Lexes text[0, n) into `spans` one window of about SPAN_WINDOW bytes at a time and calls
+// fn(window, spans, count) for each. Windows end on segment boundaries, so together they
+// yield exactly the segments of the whole text; `spans` is scratch reused across windows.
+constexpr size_t SPAN_WINDOW = 1 << 14;
+
+template <class Fn>
+void for_each_span_window(const char* text, size_t n, std::vector<SegmentSpan>& spans, Fn&& fn) {
+    if (spans.size() < SPAN_WINDOW) spans.resize(SPAN_WINDOW);     // Room for the segments of any window
+
+    size_t pos = 0;
+    while (pos < n) {
+        size_t end = n;
+        if (n - pos > SPAN_WINDOW) {
+            end = pos + last_segment_start(text + pos, SPAN_WINDOW);
+            if (end == pos) end = segment_end(text, pos, n);        // One segment longer than a window
+        }
+        const size_t count = lex_spans(text + pos, end - pos, spans.data());
+        fn(text + pos, spans.data(), count);
+        pos = end;
+    }
+}
+
+// 64-bit hash over raw bytes (8 bytes per step, multiplicative mixing).
+inline uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        std::memcpy(&w, data + i, len - i);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h * 0xBF58476D1CE4E5B9ULL;
+}
+
 // Memory Pool for Inverted Index
 // Stores all pair positions in a single contiguous array. 
 // Each pair keeps a linked list of positions using indices into this pool.
@@ -40,126 +327,1845 @@ struct IndexPool {
         pool.push_back({pos, head});                    // O(1) insertion: prepend a new position to the linked list
         head = static_cast<int32_t>(pool.size() - 1);   // pointed to by 'head'
     }
+
+    // Drop every node that is unreachable from `map` or whose position no longer holds
+    // its pair (`live(key, pos)` is false), then slide the survivors down in place and
+    // rewrite the list heads in `map`. Returns the number of nodes reclaimed.
+    //   1. walk each list, unlinking dead nodes and marking survivors in a bitmap
+    //   2. new index of a survivor = number of survivors before it (bitmap rank)
+    //   3. copy survivors down in ascending order (a node never moves up)
+    template <class Map, class Live>
+    size_t compact(Map& map, Live&& live) {
+        std::vector<uint64_t> keep((pool.size() + 63) / 64, 0);
+
+        for (auto& entry : map.table) {
+            if (!Map::occupied(entry)) continue;
+            int32_t* link = &entry.head;
+            for (int32_t i = entry.head; i != -1; i = pool[i].next) {
+                if (!live(entry.key, pool[i].pos)) continue;
+                *link = i;
+                link = &pool[i].next;
+                keep[i >> 6] |= uint64_t(1) << (i & 63);
+            }
+            *link = -1;
+        }
+
+        std::vector<uint32_t> rank_base(keep.size());
+        uint32_t kept = 0;
+        for (size_t w = 0; w < keep.size(); w++) {
+            rank_base[w] = kept;
+            kept += __builtin_popcountll(keep[w]);
+        }
+        auto rank = [&](int32_t i) -> int32_t {
+            if (i < 0) return -1;
+            const uint64_t below = keep[i >> 6] & ((uint64_t(1) << (i & 63)) - 1);
+            return static_cast<int32_t>(rank_base[i >> 6] + __builtin_popcountll(below));
+        };
+
+        for (size_t w = 0; w < keep.size(); w++) {
+            for (uint64_t bits = keep[w]; bits; bits &= bits - 1) {
+                const int32_t i = static_cast<int32_t>(w * 64 + __builtin_ctzll(bits));
+                const Node node = pool[i];
+                pool[rank(i)] = {node.pos, rank(node.next)};
+            }
+        }
+        for (auto& entry : map.table) {
+            if (Map::occupied(entry)) entry.head = rank(entry.head);
+        }
+
+        const size_t reclaimed = pool.size() - kept;
+        pool.resize(kept);
+        pool.shrink_to_fit();                           // Actually return the memory
+        return reclaimed;
+    }
 };
 
 // Cache-Friendly Linear Probing Map
 // Maps a packed token pair (uint64_t) to:
 //   - current frequency count
 //   - head of the inverted index list in IndexPool
+// Erased entries become tombstones so probe chains through them stay intact. The table
+// doubles once live entries pass the load factor, and is rehashed in place when
+// tombstones alone push it over. Growing moves entries: Entry pointers and slot indices
+// are only valid until the next insert().
 class FastPairMap {
 public:
+    static constexpr uint64_t EMPTY     = UINT64_MAX;
+    static constexpr uint64_t TOMBSTONE = UINT64_MAX - 1;      // Never a valid pack(a, b): ids stay below 2^32 - 1
+
     struct Entry {
-        uint64_t key;                           // Packed (a, b) pair, UINT64_MAX = empty
+        uint64_t key;                           // Packed (a, b) pair, EMPTY / TOMBSTONE otherwise
         uint32_t count;                         // Current frequency of this pair
         int32_t head;                           // Head of linked list in IndexPool
     };
 
     std::vector<Entry> table;
     uint32_t mask;
+    size_t live = 0;                            // Entries holding a key
+    size_t tombstones = 0;
+    uint32_t resizes = 0;                       // Rehashes so far (growth or tombstone purge)
+    double max_load = 0.7;                      // Max (live + tombstones) / capacity
 
     FastPairMap(size_t size_pow2) {
-        table.resize(size_pow2, {UINT64_MAX, 0, -1});
+        table.resize(size_pow2, {EMPTY, 0, -1});
         mask = static_cast<uint32_t>(size_pow2 - 1);
     }
 
-    // Lookup or insertion slot for a key.
-    // Returns either:
-    //   - pointer to existing entry
-    //   - pointer to an empty slot where the key can be inserted
-    inline Entry* get(uint64_t key) {
-        uint32_t idx = (key * 0x9E3779B97F4A7C15ULL) & mask;
+    static inline bool occupied(const Entry& e) { return e.key < TOMBSTONE; }
+
+    // Multiplicative hash. The slot comes from the high half of the product: the low bits
+    // only depend on the low bits of the key (the right token), which clusters badly.
+    static inline uint32_t home(uint64_t key, uint32_t mask) {
+        return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    }
+
+    size_t size() const { return live; }
+
+    // Entry for `key`, or nullptr if absent.
+    inline Entry* find(uint64_t key) {
+        return const_cast<Entry*>(static_cast<const FastPairMap*>(this)->find(key));
+    }
+
+    inline const Entry* find(uint64_t key) const {
+        uint32_t idx = home(key, mask);
+        while (true) {
+            const Entry& e = table[idx];
+            if (e.key == key) return &e;
+            if (e.key == EMPTY) return nullptr;
+            idx = (idx + 1) & mask;
+        }
+    }
+
+    // Entry for `key`, inserted as {key, 0, -1} if absent (reusing the first tombstone
+    // on its probe chain). May rehash, which invalidates earlier Entry pointers.
+    inline Entry* insert(uint64_t key) {
+        uint32_t idx = home(key, mask);
+        int64_t reuse = -1;
+        while (true) {
+            Entry& e = table[idx];
+            if (e.key == key) return &e;
+            if (e.key == EMPTY) break;
+            if (e.key == TOMBSTONE && reuse < 0) reuse = idx;
+            idx = (idx + 1) & mask;
+        }
+
+        if (reuse >= 0) {
+            idx = static_cast<uint32_t>(reuse);
+            tombstones--;
+        } else if (live + tombstones + 1 > max_load * table.size()) {
+            rehash(live + 1 > max_load * table.size() / 2 ? table.size() * 2 : table.size());
+            return insert(key);
+        }
+
+        table[idx] = {key, 0, -1};
+        live++;
+        return &table[idx];
+    }
+
+    inline void erase(Entry* e) {
+        *e = {TOMBSTONE, 0, -1};
+        live--;
+        tombstones++;
+    }
+
+    // Remove every entry, keeping the capacity.
+    void clear() {
+        std::fill(table.begin(), table.end(), Entry{EMPTY, 0, -1});
+        live = 0;
+        tombstones = 0;
+    }
+
+    void rehash(size_t new_size) {
+        std::vector<Entry> old(new_size, {EMPTY, 0, -1});
+        old.swap(table);
+        mask = static_cast<uint32_t>(new_size - 1);
+        tombstones = 0;
+        resizes++;
+        for (const Entry& e : old) {
+            if (!occupied(e)) continue;
+            uint32_t idx = home(e.key, mask);
+            while (table[idx].key != EMPTY) idx = (idx + 1) & mask;
+            table[idx] = e;
+        }
+    }
+
+    // Probe lengths of successful lookups (1 = found in its home slot).
+    struct ProbeStats {
+        double avg_probe = 0;
+        uint32_t max_probe = 0;
+        double load = 0;                        // (live + tombstones) / capacity
+    };
+
+    ProbeStats probe_stats() const {
+        ProbeStats ps;
+        uint64_t total = 0;
+        for (size_t i = 0; i < table.size(); i++) {
+            if (!occupied(table[i])) continue;
+            const uint32_t probe = ((static_cast<uint32_t>(i) - home(table[i].key, mask)) & mask) + 1;
+            total += probe;
+            ps.max_probe = std::max(ps.max_probe, probe);
+        }
+        ps.avg_probe = live ? double(total) / live : 0;
+        ps.load = double(live + tombstones) / table.size();
+        return ps;
+    }
+};
+
+// Swiss-Table Style Pair Map
+// Same interface and Entry as FastPairMap, different layout: every slot has a control
+// byte holding a 7-bit fingerprint of the key's hash (or EMPTY / DELETED) in a separate
+// array. Slots are probed in aligned groups of 16: one SSE2 compare matches the
+// fingerprint against the whole group, and an Entry is read only on a fingerprint hit.
+// Groups follow a triangular sequence, which visits every group of a power-of-two table.
+class SwissPairMap {
+public:
+    using Entry = FastPairMap::Entry;
+    using ProbeStats = FastPairMap::ProbeStats;
+
+    static constexpr size_t GROUP = 16;
+    static constexpr int8_t CTRL_EMPTY   = -128;       // 0x80
+    static constexpr int8_t CTRL_DELETED = -2;         // 0xFE (fingerprints are 0x00..0x7F)
+
+    std::vector<Entry> table;
+    std::vector<int8_t> ctrl;
+    size_t group_mask;
+    size_t live = 0;                            // Entries holding a key
+    size_t tombstones = 0;
+    uint32_t resizes = 0;                       // Rehashes so far (growth or tombstone purge)
+    double max_load = 0.8;                      // Max (live + tombstones) / capacity
+
+    SwissPairMap(size_t size_pow2) {
+        const size_t size = std::max(size_pow2, GROUP);
+        table.assign(size, {FastPairMap::EMPTY, 0, -1});
+        ctrl.assign(size, CTRL_EMPTY);
+        group_mask = size / GROUP - 1;
+    }
+
+    static inline bool occupied(const Entry& e) { return FastPairMap::occupied(e); }
+
+    size_t size() const { return live; }
+
+    static inline uint64_t hash(uint64_t key) { return key * 0x9E3779B97F4A7C15ULL; }
+    static inline size_t group_of(uint64_t h, size_t group_mask) { return static_cast<size_t>(h >> 32) & group_mask; }
+    static inline int8_t fingerprint(uint64_t h) { return static_cast<int8_t>((h >> 25) & 0x7F); }
+
+    // Bit i set if group[i] == byte.
+    static inline uint32_t match(const int8_t* group, int8_t byte) {
+#if defined(__SSE2__)
+        const __m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(byte))));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < GROUP; i++) m |= uint32_t(group[i] == byte) << i;
+        return m;
+#endif
+    }
+
+    // Bit i set if group[i] is EMPTY or DELETED (the only control bytes with the sign bit).
+    static inline uint32_t match_free(const int8_t* group) {
+#if defined(__SSE2__)
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))));
+#else
+        uint32_t m = 0;
+        for (size_t i = 0; i < GROUP; i++) m |= uint32_t(group[i] < 0) << i;
+        return m;
+#endif
+    }
+
+    // Entry for `key`, or nullptr if absent.
+    inline Entry* find(uint64_t key) {
+        return const_cast<Entry*>(static_cast<const SwissPairMap*>(this)->find(key));
+    }
+
+    inline const Entry* find(uint64_t key) const {
+        const uint64_t h = hash(key);
+        const int8_t tag = fingerprint(h);
+        size_t g = group_of(h, group_mask);
+        for (size_t step = 1; ; step++) {
+            const int8_t* c = ctrl.data() + g * GROUP;
+            for (uint32_t m = match(c, tag); m; m &= m - 1) {
+                const Entry& e = table[g * GROUP + __builtin_ctz(m)];
+                if (e.key == key) return &e;
+            }
+            if (match(c, CTRL_EMPTY)) return nullptr;
+            g = (g + step) & group_mask;
+        }
+    }
+
+    // Entry for `key`, inserted as {key, 0, -1} if absent (into the first free slot on
+    // its probe sequence). May rehash, which invalidates earlier Entry pointers.
+    inline Entry* insert(uint64_t key) {
+        if (Entry* e = find(key)) return e;
+
+        if (live + tombstones + 1 > max_load * table.size()) {
+            rehash(live + 1 > max_load * table.size() / 2 ? table.size() * 2 : table.size());
+        }
+
+        const size_t slot = free_slot(hash(key));
+        if (ctrl[slot] == CTRL_DELETED) tombstones--;
+        ctrl[slot] = fingerprint(hash(key));
+        table[slot] = {key, 0, -1};
+        live++;
+        return &table[slot];
+    }
+
+    inline void erase(Entry* e) {
+        const size_t slot = static_cast<size_t>(e - table.data());
+        ctrl[slot] = CTRL_DELETED;
+        *e = {FastPairMap::TOMBSTONE, 0, -1};
+        live--;
+        tombstones++;
+    }
+
+    void rehash(size_t new_size) {
+        std::vector<Entry> old(new_size, {FastPairMap::EMPTY, 0, -1});
+        old.swap(table);
+        ctrl.assign(new_size, CTRL_EMPTY);
+        group_mask = new_size / GROUP - 1;
+        tombstones = 0;
+        resizes++;
+        for (const Entry& e : old) {
+            if (!occupied(e)) continue;
+            const size_t slot = free_slot(hash(e.key));
+            ctrl[slot] = fingerprint(hash(e.key));
+            table[slot] = e;
+        }
+    }
+
+    // Probe lengths of successful lookups, counted in groups (1 = found in its home group).
+    ProbeStats probe_stats() const {
+        ProbeStats ps;
+        uint64_t total = 0;
+        for (size_t i = 0; i < table.size(); i++) {
+            if (!occupied(table[i])) continue;
+            size_t g = group_of(hash(table[i].key), group_mask);
+            uint32_t probe = 1;
+            for (size_t step = 1; g != i / GROUP; step++, probe++) g = (g + step) & group_mask;
+            total += probe;
+            ps.max_probe = std::max(ps.max_probe, probe);
+        }
+        ps.avg_probe = live ? double(total) / live : 0;
+        ps.load = double(live + tombstones) / table.size();
+        return ps;
+    }
+
+private:
+    inline size_t free_slot(uint64_t h) const {
+        size_t g = group_of(h, group_mask);
+        for (size_t step = 1; ; step++) {
+            const uint32_t m = match_free(ctrl.data() + g * GROUP);
+            if (m) return g * GROUP + __builtin_ctz(m);
+            g = (g + step) & group_mask;
+        }
+    }
+};
+
+// Pair map layouts selectable for training statistics and encode lookups
+enum PairMapKind : uint8_t { PAIR_MAP_LINEAR, PAIR_MAP_SWISS };
+
+// Direct-Indexed Merge Rank Table (inference only, vocab <= 65536)
+// Answers rank(a, b) without hashing:
+//   - byte-level pairs (a, b < 256) come from a dense 256 x 256 table
+//   - other pairs: offsets[a] .. offsets[a + 1] is the slice of merges with left token a,
+//     sorted by right token (uint16), searched by branch-free bisection
+struct RankTable {
+    static constexpr size_t MAX_VOCAB = 65536;
+    static constexpr size_t AUTO_MAX_VOCAB = 2048;     // Above this, rows get long enough that hashing wins
+
+    std::vector<int32_t> byte_ranks;            // 256 * 256, -1 = no merge
+    std::vector<uint32_t> offsets;              // vocab_size + 1
+    std::vector<uint16_t> rights;               // Right token of each merge, grouped by left token
+    std::vector<int32_t> ranks;                 // Merge rank, parallel to `rights`
+
+    // What rank() reads: the vectors above, or arrays inside a mapped v2 model (attach()).
+    struct View {
+        const int32_t* byte_ranks = nullptr;
+        const uint32_t* offsets = nullptr;
+        const uint16_t* rights = nullptr;
+        const int32_t* ranks = nullptr;
+        size_t offset_count = 0;
+        size_t entry_count = 0;
+    } view;
+
+    RankTable() = default;
+    RankTable(const RankTable& other) { *this = other; }
+    RankTable& operator=(const RankTable& other) {
+        byte_ranks = other.byte_ranks;
+        offsets = other.offsets;
+        rights = other.rights;
+        ranks = other.ranks;
+        if (other.view.byte_ranks == other.byte_ranks.data() && !byte_ranks.empty()) own_view();
+        else view = other.view;                 // Attached: both point at the same mapping
+        return *this;
+    }
+
+    template <class MergeRule>
+    void build(const std::vector<MergeRule>& merges, size_t vocab_size) {
+        for (const auto& m : merges) {                  // Rows are indexed by token, so both must be in the vocab
+            if (m.a >= vocab_size || m.b >= vocab_size) {
+                throw std::runtime_error("Merge rule token out of range for the rank table");
+            }
+        }
+        byte_ranks.assign(256 * 256, -1);
+        offsets.assign(vocab_size + 1, 0);
+
+        for (const auto& m : merges) {
+            if (m.a < 256 && m.b < 256) continue;
+            offsets[m.a + 1]++;
+        }
+        for (size_t i = 0; i < vocab_size; i++) offsets[i + 1] += offsets[i];
+
+        rights.assign(offsets[vocab_size], 0);
+        ranks.assign(offsets[vocab_size], -1);
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+
+        for (size_t i = 0; i < merges.size(); i++) {
+            const auto& m = merges[i];
+            if (m.a < 256 && m.b < 256) {
+                byte_ranks[(m.a << 8) | m.b] = static_cast<int32_t>(i);
+                continue;
+            }
+            rights[fill[m.a]] = static_cast<uint16_t>(m.b);
+            ranks[fill[m.a]++] = static_cast<int32_t>(i);
+        }
+
+        std::vector<std::pair<uint16_t, int32_t>> row;
+        for (size_t a = 0; a < vocab_size; a++) {
+            const uint32_t lo = offsets[a], hi = offsets[a + 1];
+            if (hi - lo < 2) continue;
+            row.clear();
+            for (uint32_t k = lo; k < hi; k++) row.push_back({rights[k], ranks[k]});
+            std::sort(row.begin(), row.end());
+            for (uint32_t k = lo; k < hi; k++) {
+                rights[k] = row[k - lo].first;
+                ranks[k]  = row[k - lo].second;
+            }
+        }
+        own_view();
+    }
+
+    // Serve rank() from external arrays (laid out as by build()) without copying them.
+    void attach(const View& external) {
+        byte_ranks.clear();
+        offsets.clear();
+        rights.clear();
+        ranks.clear();
+        view = external;
+    }
+
+    inline int32_t rank(uint32_t a, uint32_t b) const {
+        if ((a | b) < 256) return view.byte_ranks[(a << 8) | b];
+        if (a >= view.offset_count - 1) return -1;     // Not a + 1: that wraps for a = UINT32_MAX
+
+        const uint32_t lo = view.offsets[a];
+        uint32_t len = view.offsets[a + 1] - lo;
+        if (len == 0) return -1;
+
+        const uint16_t* base = view.rights + lo;
+        while (len > 1) {                       // Branch-free bisection: the step is a conditional move
+            const uint32_t half = len / 2;
+            base = base[half] <= b ? base + half : base;
+            len -= half;
+        }
+        return *base == b ? view.ranks[base - view.rights] : -1;
+    }
+
+private:
+    void own_view() {
+        view = {byte_ranks.data(), offsets.data(), rights.data(), ranks.data(), offsets.size(), rights.size()};
+    }
+};
+
+// Writes a file through write(out) into a temporary next to `path`, then renames it over
+// `path`. Replacing the file this way never truncates the old one: a v2 model being
+// saved over itself, or mapped by other processes, stays intact until they unmap it.
+template <class Write>
+void write_file_replacing(const std::string& path, Write&& write) {
+    const std::string tmp = path + ".tmp." + std::to_string(getpid());
+    try {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Cannot open file for writing");
+        }
+        write(out);
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Error occurred while writing tokenizer file");
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Cannot replace file");
+        }
+    } catch (...) {
+        std::remove(tmp.c_str());
+        throw;
+    }
+}
+
+// Copies src[0, len) to dst in whole 32-byte (AVX2) or 16-byte (SSE2) blocks. Reads and
+// writes up to TOKEN_PAD - 1 bytes past `len`: both buffers need that much slack.
+const size_t TOKEN_PAD = 32;
+
+inline void copy_token(char* dst, const char* src, size_t len) {
+#if defined(__AVX2__)
+    size_t k = 0;
+    do {                                        // Most tokens take exactly one block
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + k), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + k)));
+        k += 32;
+    } while (k < len);
+#elif defined(__SSE2__)
+    size_t k = 0;
+    do {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k)));
+        k += 16;
+    } while (k < len);
+#else
+    std::memcpy(dst, src, len);
+#endif
+}
+
+// Token Vocabulary
+// Token strings back to back in one byte arena; token i is bytes[offsets[i], offsets[i + 1]).
+//   - adding a token is an append to each array, never an allocation of its own
+//   - decode copies straight out of the one block
+//   - the arena is followed by TOKEN_PAD zero bytes, so copy_token() may over-read
+//   - a mapped v2 model can lend both arrays instead (attach()); nothing is copied
+class TokenVocab {
+public:
+    size_t size() const { return count; }
+    size_t byte_size() const { return offset_data()[count]; }
+
+    std::string_view operator[](size_t id) const {
+        const uint32_t* o = offset_data();
+        return {byte_data() + o[id], o[id + 1] - o[id]};
+    }
+
+    const char* byte_data() const { return mapped_bytes ? mapped_bytes : bytes.data(); }
+    const uint32_t* offset_data() const { return mapped_offsets ? mapped_offsets : offsets.data(); }
+
+    void clear() {
+        bytes.assign(TOKEN_PAD, '\0');
+        offsets.assign(1, 0);
+        mapped_bytes = nullptr;
+        mapped_offsets = nullptr;
+        count = 0;
+    }
+
+    void reserve(size_t tokens, size_t byte_count) {
+        offsets.reserve(tokens + 1);
+        bytes.reserve(byte_count + TOKEN_PAD);
+    }
+
+    // Appends a token of `len` bytes and returns where to write them. Invalidates
+    // pointers and views into the arena.
+    char* add(size_t len) {
+        if (mapped_bytes) own();
+        const size_t at = offsets.back();
+        bytes.resize(at + len + TOKEN_PAD);                     // Old padding is overwritten, new padding is zero
+        offsets.push_back(static_cast<uint32_t>(at + len));
+        count++;
+        return &bytes[at];
+    }
+
+    void push_back(std::string_view token) {
+        std::memcpy(add(token.size()), token.data(), token.size());
+    }
+
+    // Appends the concatenation of tokens a and b (the string of a new merge).
+    void push_merged(uint32_t a, uint32_t b) {
+        if (mapped_bytes) own();
+        const uint32_t a0 = offsets[a], a1 = offsets[a + 1];
+        const uint32_t b0 = offsets[b], b1 = offsets[b + 1];
+        char* out = add((a1 - a0) + (b1 - b0));                 // May move the arena: copy by offset
+        std::memcpy(out, bytes.data() + a0, a1 - a0);
+        std::memcpy(out + (a1 - a0), bytes.data() + b0, b1 - b0);
+    }
+
+    // Serve `tokens` tokens from external arrays laid out like ours (including TOKEN_PAD
+    // readable bytes after the last token), without copying. The memory must outlive this
+    // vocab (or its next add()).
+    void attach(const char* data, const uint32_t* token_offsets, size_t tokens) {
+        bytes.clear();
+        offsets.clear();
+        mapped_bytes = data;
+        mapped_offsets = token_offsets;
+        count = tokens;
+    }
+
+    // Same, copying the arrays in (for external data without the padding).
+    void assign(const char* data, const uint32_t* token_offsets, size_t tokens) {
+        attach(data, token_offsets, tokens);
+        own();
+    }
+
+private:
+    std::string bytes = std::string(TOKEN_PAD, '\0');
+    std::vector<uint32_t> offsets{0};
+    const char* mapped_bytes = nullptr;
+    const uint32_t* mapped_offsets = nullptr;
+    size_t count = 0;
+
+    void own() {                                                // Copy attached arrays in before modifying
+        const char* data = mapped_bytes;
+        const uint32_t* o = mapped_offsets;
+        bytes.assign(data, o[count]);
+        bytes.append(TOKEN_PAD, '\0');
+        offsets.assign(o, o + count + 1);
+        mapped_bytes = nullptr;
+        mapped_offsets = nullptr;
+    }
+};
+
+// Incremental Decoder
+// Decodes token IDs one at a time (as a model generates them) into text that never ends
+// inside a UTF-8 sequence:
+//   - each token's bytes go into a fixed ring buffer, sized at construction for the
+//     longest token, the at most 3 bytes that can be held back and copy_token() slack
+//   - push() emits the buffered bytes up to the last complete sequence, as a view into
+//     the ring (or, if they wrap, into a fixed output buffer) valid until the next call
+//   - nothing is allocated after construction
+// Bytes that can never complete a sequence (stray continuation bytes, invalid leads) are
+// passed through as they are; flush() emits whatever is still held back.
+class StreamDecoder {
+public:
+    explicit StreamDecoder(const TokenVocab& vocab) : vocab(&vocab) {
+        size_t longest = 0;
+        const uint32_t* o = vocab.offset_data();
+        for (size_t i = 0; i < vocab.size(); i++) longest = std::max<size_t>(longest, o[i + 1] - o[i]);
+
+        size_t capacity = 16;
+        while (capacity < longest + 4 + TOKEN_PAD) capacity <<= 1;     // Free space after the tail >= TOKEN_PAD
+        ring.assign(capacity + TOKEN_PAD, '\0');
+        out.assign(capacity, '\0');
+        mask = capacity - 1;
+    }
+
+    // Appends token `id` (unknown IDs are skipped, as in decode()) and returns the bytes
+    // that now end on a sequence boundary.
+    std::string_view push(uint32_t id) {
+        if (id < vocab->size()) {
+            const std::string_view token = (*vocab)[id];
+            const size_t at = tail & mask;
+            if (at + token.size() <= mask + 1) {
+                copy_token(&ring[at], token.data(), token.size());         // Over-writes only free bytes / slack
+            } else {
+                const size_t first = mask + 1 - at;                         // Wraps
+                std::memcpy(&ring[at], token.data(), first);
+                std::memcpy(&ring[0], token.data() + first, token.size() - first);
+            }
+            tail += token.size();
+        }
+        return emit(tail - held_back());
+    }
+
+    // Emits every buffered byte, complete or not (end of the stream).
+    std::string_view flush() { return emit(tail); }
+
+    void reset() { head = tail = 0; }
+
+    size_t pending() const { return tail - head; }
+
+private:
+    const TokenVocab* vocab;
+    std::string ring;
+    std::string out;
+    size_t mask = 0;
+    uint64_t head = 0;                                  // Stream positions; ring index = position & mask
+    uint64_t tail = 0;
+
+    unsigned char at(uint64_t pos) const { return static_cast<unsigned char>(ring[pos & mask]); }
+
+    // Trailing bytes that start a UTF-8 sequence not yet complete.
+    size_t held_back() const {
+        const size_t available = std::min<uint64_t>(tail - head, 4);
+        for (size_t k = 1; k <= available; k++) {
+            const unsigned char c = at(tail - k);
+            if ((c & 0xC0) == 0x80) continue;           // Continuation byte: keep looking for the lead
+            const size_t need = (c >= 0xF0 && c < 0xF8) ? 4 : (c >= 0xE0 && c < 0xF0) ? 3 : (c >= 0xC0 && c < 0xE0) ? 2 : 1;
+            return need > k ? k : 0;
+        }
+        return 0;
+    }
+
+    std::string_view emit(uint64_t end) {
+        const size_t n = end - head;
+        const size_t from = head & mask;
+        head = end;
+        if (from + n <= mask + 1) return std::string_view(ring.data() + from, n);
+
+        const size_t first = mask + 1 - from;                           // Wrapped: linearize
+        std::memcpy(&out[0], &ring[from], first);
+        std::memcpy(&out[first], &ring[0], n - first);
+        return std::string_view(out.data(), n);
+    }
+};
+
+// Model format v2 (memory-mappable). Little-endian; every section starts on a
+// MODEL_ALIGN boundary so arrays can be used in place from an mmap'd file:
+//   header       ModelHeaderV2
+//   merges       MergeRule x merge_count
+//   offsets      u32 x (vocab_size + 1), token i = bytes[offsets[i], offsets[i + 1])
+//   bytes        token bytes, concatenated
+//   rank table   RankTable arrays (byte_ranks, offsets, rights, ranks); absent (at = 0)
+//                unless the writer's encode used it (by default, vocabs up to
+//                RankTable::AUTO_MAX_VOCAB)
+//   word table   u32 x (word_count + 1) offsets, then the segment bytes (word i is
+//                bytes[offsets[i], offsets[i + 1])); load() re-encodes them into
+//                BPETokenizer::word_table. Absent (word_count = 0) if it was empty
+struct ModelHeaderV2 {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vocab_size;
+    uint32_t merge_count;
+    uint64_t merges_at;
+    uint64_t offsets_at;
+    uint64_t bytes_at;
+    uint64_t bytes_size;
+    uint64_t rank_entries;                      // Length of rights / ranks
+    uint64_t byte_ranks_at;
+    uint64_t rank_offsets_at;
+    uint64_t rights_at;
+    uint64_t ranks_at;
+    uint64_t word_count;                        // Zero in files written before the word table section
+    uint64_t word_offsets_at;
+    uint64_t word_bytes_at;
+};
+
+const size_t MODEL_ALIGN = 64;
+
+inline uint64_t align_up(uint64_t n, uint64_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+}
+
+// Read-only memory mapping of a whole file (POSIX mmap), unmapped on destruction.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("File not found");
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("File read error");
+        }
+        bytes = static_cast<size_t>(st.st_size);
+        if (bytes > 0) {
+            void* p = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Cannot map file");
+            }
+            base = static_cast<const char*>(p);
+        }
+        ::close(fd);                            // The mapping stays valid without the descriptor
+    }
+
+    ~MappedFile() {
+        if (base) ::munmap(const_cast<char*>(base), bytes);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return base; }
+    size_t size() const { return bytes; }
+
+private:
+    const char* base = nullptr;
+    size_t bytes = 0;
+};
+
+// How encode looks up merge ranks: AUTO picks RANK_TABLE for vocabs up to
+// RankTable::AUTO_MAX_VOCAB (where it beats hashing end to end), else HASH (the pair map
+// layout given by inference_map_kind).
+enum InferenceLookup : uint8_t { LOOKUP_AUTO, LOOKUP_HASH, LOOKUP_RANK_TABLE };
+
+// True if any bit in (a, b] is set. `bits` is a bitmap over token positions.
+inline bool segment_start_between(const std::vector<uint64_t>& bits, size_t a, size_t b) {
+    size_t i = a + 1;
+    while (i <= b) {
+        const uint64_t word = bits[i >> 6] >> (i & 63);
+        if (word) return i + __builtin_ctzll(word) <= b;
+        i = (i | 63) + 1;
+    }
+    return false;
+}
+
+using Clock = std::chrono::steady_clock;
+
+inline double seconds(Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double>(to - from).count();
+}
+
+// Sort non-negative positions (all < limit) in place.
+// Small lists use std::sort; larger ones an LSD radix sort with 11-bit digits, which
+// needs only as many passes as `limit` has digits (two for up to 4M tokens).
+// `tmp` is scratch storage kept by the caller so repeated calls do not allocate.
+inline void sort_positions(std::vector<int32_t>& v, std::vector<int32_t>& tmp, size_t limit) {
+    if (v.size() < 256) {
+        std::sort(v.begin(), v.end());
+        return;
+    }
+
+    tmp.resize(v.size());
+    uint32_t count[2048];
+    for (uint32_t shift = 0; shift < 32 && (size_t(1) << shift) < limit; shift += 11) {
+        std::memset(count, 0, sizeof(count));
+        for (int32_t x : v) count[(uint32_t(x) >> shift) & 2047]++;
+
+        uint32_t sum = 0;
+        for (uint32_t d = 0; d < 2048; d++) {
+            const uint32_t c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (int32_t x : v) tmp[count[(uint32_t(x) >> shift) & 2047]++] = x;
+        v.swap(tmp);
+    }
+}
+
+// Runs fn(0) .. fn(tasks - 1), one thread per task (the calling thread takes task 0).
+template <class Fn>
+void parallel_for(size_t tasks, Fn&& fn) {
+    std::vector<std::thread> workers;
+    workers.reserve(tasks);
+    for (size_t t = 1; t < tasks; t++) {
+        workers.emplace_back([&fn, t] { fn(t); });
+    }
+    if (tasks > 0) fn(0);
+    for (auto& th : workers) th.join();
+}
+
+// Runs fn(worker, task) for every task in [0, tasks) on `workers` threads (the calling
+// thread is worker 0). Each worker starts with a contiguous block of tasks and takes them
+// from the front; a worker that runs dry steals the back half of another worker's block,
+// so uneven tasks still keep every thread busy.
+template <class Fn>
+void parallel_for_stealing(size_t tasks, size_t workers, Fn&& fn) {
+    workers = std::max<size_t>(1, std::min(workers, tasks));
+    struct alignas(64) Block {
+        std::mutex lock;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+    std::vector<Block> blocks(workers);
+    for (size_t w = 0; w < workers; w++) {
+        blocks[w].begin = tasks * w / workers;
+        blocks[w].end = tasks * (w + 1) / workers;
+    }
+
+    auto take = [&](size_t w, size_t& task) {
+        {
+            std::lock_guard<std::mutex> guard(blocks[w].lock);
+            if (blocks[w].begin < blocks[w].end) {
+                task = blocks[w].begin++;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < workers; k++) {                  // Steal, scanning from the next worker
+            Block& victim = blocks[(w + k) % workers];
+            size_t lo, hi;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.begin >= victim.end) continue;
+                hi = victim.end;
+                lo = victim.begin + (victim.end - victim.begin) / 2;
+                victim.end = lo;
+            }
+            std::lock_guard<std::mutex> guard(blocks[w].lock);
+            blocks[w].begin = lo + 1;
+            blocks[w].end = hi;
+            task = lo;
+            return true;
+        }
+        return false;
+    };
+
+    parallel_for(workers, [&](size_t w) {
+        size_t task;
+        while (take(w, task)) fn(w, task);
+    });
+}
+
+// Indexed Max-Heap over pair map slots (FastPairMap or SwissPairMap)
+// Alternative to the lazy-deletion priority queue in train(): every live pair is in the
+// heap at most once and is moved in place when its count changes (increase- and
+// decrease-key through `where`). Memory is bounded by the number of live pairs and the
+// top is never stale. Ordered by (count, key) descending, like the lazy queue.
+template <class PairMap>
+class IndexedPairHeap {
+public:
+    IndexedPairHeap(const PairMap& map) : map(map), where(map.table.size(), -1) {}
+
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    uint32_t top() const { return heap[0]; }
+    bool contains(uint32_t slot) const { return where[slot] >= 0; }
+
+    // Insert, move or drop `slot` after its count changed. `keep` = still a candidate.
+    void update(uint32_t slot, bool keep) {
+        if (!keep) {
+            remove(slot);
+            return;
+        }
+        if (where[slot] < 0) {
+            where[slot] = static_cast<int32_t>(heap.size());
+            heap.push_back(slot);
+        }
+        size_t i = sift_up(static_cast<size_t>(where[slot]));
+        sift_down(i);
+    }
+
+    // Re-index after the map rehashed: queue every slot with keep(entry) and heapify.
+    template <class Keep>
+    void rebuild(Keep&& keep) {
+        heap.clear();
+        where.assign(map.table.size(), -1);
+        for (uint32_t slot = 0; slot < map.table.size(); slot++) {
+            if (PairMap::occupied(map.table[slot]) && keep(map.table[slot])) {
+                where[slot] = static_cast<int32_t>(heap.size());
+                heap.push_back(slot);
+            }
+        }
+        for (size_t i = heap.size() / 2; i-- > 0;) sift_down(i);
+    }
+
+    void remove(uint32_t slot) {
+        const int32_t i = where[slot];
+        if (i < 0) return;
+        const uint32_t last = heap.back();
+        heap.pop_back();
+        where[slot] = -1;
+        if (last != slot) {
+            heap[i] = last;
+            where[last] = i;
+            sift_down(sift_up(static_cast<size_t>(i)));
+        }
+    }
+
+private:
+    const PairMap& map;
+    std::vector<uint32_t> heap;                 // Slots, max-heap ordered
+    std::vector<int32_t> where;                 // Slot -> heap index (-1 = not queued)
+
+    inline bool above(uint32_t x, uint32_t y) const {
+        const auto& a = map.table[x];
+        const auto& b = map.table[y];
+        return a.count != b.count ? a.count > b.count : a.key > b.key;
+    }
+
+    inline void place(size_t i, uint32_t slot) {
+        heap[i] = slot;
+        where[slot] = static_cast<int32_t>(i);
+    }
+
+    size_t sift_up(size_t i) {
+        const uint32_t slot = heap[i];
+        while (i > 0) {
+            const size_t parent = (i - 1) / 2;
+            if (!above(slot, heap[parent])) break;
+            place(i, heap[parent]);
+            i = parent;
+        }
+        place(i, slot);
+        return i;
+    }
+
+    void sift_down(size_t i) {
+        const uint32_t slot = heap[i];
+        const size_t n = heap.size();
         while (true) {
-            if (table[idx].key == key) return &table[idx];
-            if (table[idx].key == UINT64_MAX) return &table[idx];
+            size_t child = 2 * i + 1;
+            if (child >= n) break;
+            if (child + 1 < n && above(heap[child + 1], heap[child])) child++;
+            if (!above(heap[child], slot)) break;
+            place(i, heap[child]);
+            i = child;
+        }
+        place(i, slot);
+    }
+};
+
+// Segment Frequency Table
+// Collapses repeated lexer segments into unique (bytes, count) records.
+//   - segment bytes are appended once to a single arena
+//   - records keep first-occurrence order, so the layout is independent of chunking
+//   - slots are an open-addressing index (record id + 1, 0 = empty) into `records`
+struct SegmentTable {
+    struct Record {
+        uint64_t offset;                        // Start of the segment bytes in `arena`
+        uint64_t hash;                          // Full hash of the segment bytes
+        uint64_t count;                         // Number of occurrences seen so far
+        uint32_t len;                           // Segment length in bytes
+    };
+
+    std::string arena;
+    std::vector<Record> records;
+    std::vector<uint32_t> slots;
+    uint64_t mask;
+    std::vector<SegmentSpan> spans;             // Lexer scratch for add_text()
+
+    SegmentTable(size_t size_pow2 = 1 << 16) {
+        slots.assign(size_pow2, 0);
+        mask = size_pow2 - 1;
+    }
+
+    inline void add(const char* data, size_t len, uint64_t times = 1) {
+        add_hashed(data, len, hash_bytes(data, len), times);
+    }
+
+    inline void add_hashed(const char* data, size_t len, uint64_t h, uint64_t times = 1) {
+        uint64_t idx = h & mask;
+        while (slots[idx] != 0) {
+            Record& r = records[slots[idx] - 1];
+            if (r.hash == h && r.len == len && std::memcmp(arena.data() + r.offset, data, len) == 0) {
+                r.count += times;
+                return;
+            }
             idx = (idx + 1) & mask;
         }
+
+        records.push_back({arena.size(), h, times, static_cast<uint32_t>(len)});
+        arena.append(data, len);
+        slots[idx] = static_cast<uint32_t>(records.size());
+
+        if (records.size() * 2 > slots.size()) grow();  // Keep load factor <= 0.5
+    }
+
+    // Count every segment of `text` given as spans (see lex_spans()). With the boundaries
+    // known up front, hashes are computed a few segments ahead and their slots prefetched.
+    void add_spans(const char* text, const SegmentSpan* segs, size_t count) {
+        constexpr size_t AHEAD = 8;
+        uint64_t hashes[AHEAD];
+        for (size_t s = 0; s < count + AHEAD; s++) {
+            if (s >= AHEAD) {
+                const SegmentSpan& seg = segs[s - AHEAD];
+                add_hashed(text + seg.offset, seg.length, hashes[s % AHEAD]);
+            }
+            if (s < count) {
+                hashes[s % AHEAD] = hash_bytes(text + segs[s].offset, segs[s].length);
+                __builtin_prefetch(&slots[hashes[s % AHEAD] & mask]);
+            }
+        }
+    }
+
+    // Lex `text` and count every segment in it.
+    void add_text(const char* text, size_t n) {
+        for_each_span_window(text, n, spans, [&](const char* window, const SegmentSpan* segs, size_t count) {
+            add_spans(window, segs, count);
+        });
+    }
+
+    void grow() {
+        std::vector<uint32_t> bigger(slots.size() * 2, 0);
+        const uint64_t new_mask = bigger.size() - 1;
+        for (size_t r = 0; r < records.size(); r++) {
+            uint64_t idx = records[r].hash & new_mask;
+            while (bigger[idx] != 0) idx = (idx + 1) & new_mask;
+            bigger[idx] = static_cast<uint32_t>(r + 1);
+        }
+        slots.swap(bigger);
+        mask = new_mask;
+    }
+};
+
+// Streams a file through `fn(data, len)` in chunks of about `chunk_size` bytes.
+// Every chunk ends on a segment boundary: the trailing (possibly incomplete) segment is
+// carried over into the next read, so lexing chunk by chunk yields exactly the segments
+// of the whole file. A single segment longer than the buffer grows the buffer.
+template <class Fn>
+void for_each_chunk(const std::string& path, size_t chunk_size, Fn&& fn) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("Cannot open file");
+
+    std::vector<char> buf(std::max<size_t>(chunk_size, 1));
+    size_t carry = 0;
+
+    while (true) {
+        if (carry == buf.size()) buf.resize(buf.size() * 2);
+
+        in.read(buf.data() + carry, buf.size() - carry);
+        if (in.bad()) throw std::runtime_error("File read error");
+
+        const size_t total = carry + static_cast<size_t>(in.gcount());
+        if (!in) {                                              // EOF: the trailing segment is complete
+            if (total > 0) fn(buf.data(), total);
+            break;
+        }
+
+        const size_t cut = last_segment_start(buf.data(), total);
+        if (cut > 0) fn(buf.data(), cut);
+
+        carry = total - cut;
+        std::memmove(buf.data(), buf.data() + cut, carry);
+    }
+}
+
+enum CachePolicy : uint8_t { CACHE_LRU, CACHE_CLOCK };
+
+// Segment Encode Cache
+// Bounded map from raw segment bytes to their token IDs, consulted before merging.
+//   - fixed-size entries, allocated once by configure(): segments of 2..MAX_BYTES bytes
+//     that encode to at most MAX_IDS tokens; anything else is simply not cached
+//   - open-addressing index (linear probing, backward-shift deletion) over entry ids
+//   - LRU keeps entries on a recency list; CLOCK keeps a reference bit and a sweeping hand
+// Cached IDs belong to one model: clear() after the merges change.
+class SegmentCache {
+public:
+    static constexpr size_t MAX_BYTES = 32;
+    static constexpr size_t MAX_IDS = 6;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    // Capacity 0 disables the cache.
+    void configure(size_t capacity, CachePolicy cache_policy = CACHE_LRU) {
+        policy = cache_policy;
+        entries.assign(capacity, Entry());
+        size_t slot_count = 1;
+        while (slot_count < capacity * 2) slot_count <<= 1;
+        slots.assign(capacity ? slot_count : 0, -1);
+        mask = slot_count - 1;
+        clear();
+    }
+
+    size_t capacity() const { return entries.size(); }
+    size_t size() const { return used; }
+    CachePolicy eviction_policy() const { return policy; }
+
+    // Drops all entries and resets the counters; keeps capacity and policy.
+    void clear() {
+        std::fill(slots.begin(), slots.end(), -1);
+        used = 0;
+        hand = 0;
+        head = tail = -1;
+        hits = misses = evictions = 0;
+    }
+
+    // Token IDs cached for data[0, len) (hash = hash_bytes(data, len)), or nullptr.
+    const uint32_t* find(const char* data, size_t len, uint64_t hash, size_t& count) {
+        for (size_t i = hash & mask; slots[i] >= 0; i = (i + 1) & mask) {
+            Entry& e = entries[slots[i]];
+            if (e.hash == hash && e.len == len && std::memcmp(e.bytes, data, len) == 0) {
+                hits++;
+                touch(slots[i]);
+                count = e.count;
+                return e.ids;
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+
+    // Caches ids[0, count) for data[0, len), which must not be cached already.
+    void insert(const char* data, size_t len, uint64_t hash, const uint32_t* ids, size_t count) {
+        if (entries.empty() || len > MAX_BYTES || count > MAX_IDS) return;
+
+        int32_t id;
+        if (used < entries.size()) {
+            id = static_cast<int32_t>(used++);
+        } else {
+            id = victim();
+            unindex(id);
+            unlink(id);
+            evictions++;
+        }
+
+        Entry& e = entries[id];
+        e.hash = hash;
+        e.len = static_cast<uint8_t>(len);
+        e.count = static_cast<uint8_t>(count);
+        e.referenced = 0;                               // CLOCK: a segment seen once is the first to go
+        std::memcpy(e.bytes, data, len);
+        std::memcpy(e.ids, ids, count * sizeof(uint32_t));
+
+        size_t i = hash & mask;
+        while (slots[i] >= 0) i = (i + 1) & mask;
+        slots[i] = id;
+        push_front(id);
+    }
+
+private:
+    struct Entry {
+        uint64_t hash = 0;
+        int32_t prev = -1;                              // LRU list, most recent at `head`
+        int32_t next = -1;
+        uint8_t len = 0;
+        uint8_t count = 0;
+        uint8_t referenced = 0;
+        char bytes[MAX_BYTES];
+        uint32_t ids[MAX_IDS];
+    };
+
+    std::vector<Entry> entries;
+    std::vector<int32_t> slots;                         // Entry id, or -1 = empty
+    size_t mask = 0;
+    size_t used = 0;
+    size_t hand = 0;                                    // CLOCK hand
+    int32_t head = -1;
+    int32_t tail = -1;
+    CachePolicy policy = CACHE_LRU;
+
+    void touch(int32_t id) {
+        if (policy == CACHE_CLOCK) {
+            entries[id].referenced = 1;
+        } else if (id != head) {
+            unlink(id);
+            push_front(id);
+        }
+    }
+
+    int32_t victim() {
+        if (policy == CACHE_LRU) return tail;
+        while (entries[hand].referenced) {              // Second chance: clear the bit and move on
+            entries[hand].referenced = 0;
+            hand = (hand + 1) % entries.size();
+        }
+        const int32_t id = static_cast<int32_t>(hand);
+        hand = (hand + 1) % entries.size();
+        return id;
+    }
+
+    void push_front(int32_t id) {
+        if (policy != CACHE_LRU) return;
+        entries[id].prev = -1;
+        entries[id].next = head;
+        if (head >= 0) entries[head].prev = id;
+        head = id;
+        if (tail < 0) tail = id;
+    }
+
+    void unlink(int32_t id) {
+        if (policy != CACHE_LRU) return;
+        Entry& e = entries[id];
+        if (e.prev >= 0) entries[e.prev].next = e.next; else head = e.next;
+        if (e.next >= 0) entries[e.next].prev = e.prev; else tail = e.prev;
+    }
+
+    // Removes `id` from the index, shifting later members of its probe run back so no
+    // tombstones are needed.
+    void unindex(int32_t id) {
+        size_t i = entries[id].hash & mask;
+        while (slots[i] != id) i = (i + 1) & mask;
+        for (size_t j = (i + 1) & mask; slots[j] >= 0; j = (j + 1) & mask) {
+            const size_t home = entries[slots[j]].hash & mask;
+            const bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) continue;
+            slots[i] = slots[j];
+            i = j;
+        }
+        slots[i] = -1;
     }
 };
 
+// Whole-Word Table
+// Read-only map from frequent segments to their final token IDs, built once with CHD
+// ("compress, hash and displace") perfect hashing:
+//   - keys are grouped into buckets by their high hash bits; each bucket, largest first,
+//     gets the smallest displacement that sends all of its keys to still-free slots
+//   - a lookup is one bucket read and one slot read, then a byte compare
+//   - segment bytes and token IDs live in two arenas
+// Keys are added with add() and placed by build(); find() is safe to share across threads.
+class WordTable {
+public:
+    void clear() {
+        words.clear();
+        bytes.clear();
+        ids.clear();
+        displacements.clear();
+        slots.clear();
+        placed_words = 0;
+    }
+
+    size_t size() const { return placed_words; }
+
+    // Segments added so far (placed or not), e.g. to save them.
+    size_t key_count() const { return words.size(); }
+    std::string_view key(size_t w) const { return {bytes.data() + words[w].offset, words[w].len}; }
+
+    void add(const char* data, size_t len, uint64_t hash, const uint32_t* token_ids, size_t count) {
+        words.push_back({hash, static_cast<uint32_t>(bytes.size()), static_cast<uint32_t>(len),
+                         static_cast<uint32_t>(ids.size()), static_cast<uint32_t>(count)});
+        bytes.append(data, len);
+        ids.insert(ids.end(), token_ids, token_ids + count);
+    }
+
+    // Places every added key. Keys that cannot be placed (equal 64-bit hashes) are dropped.
+    void build() {
+        size_t slot_count = 1;
+        while (slot_count < words.size() * 2) slot_count <<= 1;     // Load <= 0.5: small displacements
+        size_t bucket_count = 1;
+        while (bucket_count * 4 < words.size()) bucket_count <<= 1; // ~4 keys per bucket
+        slot_mask = slot_count - 1;
+        bucket_mask = bucket_count - 1;
+
+        std::vector<std::vector<uint32_t>> buckets(bucket_count);
+        for (size_t w = 0; w < words.size(); w++) buckets[bucket_of(words[w].hash)].push_back(static_cast<uint32_t>(w));
+
+        std::vector<uint32_t> order(bucket_count);
+        for (size_t b = 0; b < bucket_count; b++) order[b] = static_cast<uint32_t>(b);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+            return buckets[x].size() > buckets[y].size();
+        });
+
+        displacements.assign(bucket_count, 0);
+        slots.assign(slot_count, -1);
+        std::vector<size_t> placed;
+        for (uint32_t b : order) {
+            if (buckets[b].empty()) break;
+            for (uint32_t d = 0; d < MAX_DISPLACEMENT; d++) {
+                placed.clear();
+                for (uint32_t w : buckets[b]) {
+                    const size_t s = slot_of(words[w].hash, d);
+                    if (slots[s] >= 0 || std::find(placed.begin(), placed.end(), s) != placed.end()) break;
+                    placed.push_back(s);
+                }
+                if (placed.size() < buckets[b].size()) continue;
+
+                displacements[b] = d;
+                for (size_t k = 0; k < placed.size(); k++) slots[placed[k]] = static_cast<int32_t>(buckets[b][k]);
+                placed_words += placed.size();
+                break;
+            }
+        }
+    }
+
+    // Token IDs for data[0, len) (hash = hash_bytes(data, len)), or nullptr.
+    const uint32_t* find(const char* data, size_t len, uint64_t hash, size_t& count) const {
+        const int32_t w = slots[slot_of(hash, displacements[bucket_of(hash)])];
+        if (w < 0) return nullptr;
+        const Word& word = words[w];
+        if (word.hash != hash || word.len != len || std::memcmp(bytes.data() + word.offset, data, len) != 0) return nullptr;
+        count = word.count;
+        return ids.data() + word.ids_offset;
+    }
+
+private:
+    static constexpr uint32_t MAX_DISPLACEMENT = 1u << 20;
+
+    struct Word {
+        uint64_t hash;
+        uint32_t offset;                                // Segment bytes in `bytes`
+        uint32_t len;
+        uint32_t ids_offset;                            // Token IDs in `ids`
+        uint32_t count;
+    };
+
+    std::vector<Word> words;
+    std::string bytes;
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> displacements;                // Per bucket
+    std::vector<int32_t> slots;                         // Word index, or -1 = empty
+    size_t slot_mask = 0;
+    size_t bucket_mask = 0;
+    size_t placed_words = 0;
+
+    size_t bucket_of(uint64_t hash) const { return (hash >> 40) & bucket_mask; }
+
+    size_t slot_of(uint64_t hash, uint32_t d) const {
+        const uint32_t h1 = static_cast<uint32_t>(hash);
+        const uint32_t h2 = static_cast<uint32_t>(hash >> 32) | 1;
+        return (h1 + d * h2) & slot_mask;
+    }
+};
+
+// Token IDs of a batch of documents, flat: document d is ids[offsets[d], offsets[d + 1]).
+struct EncodedBatch {
+    std::vector<uint32_t> ids;
+    std::vector<uint64_t> offsets;
+};
+
+// Reusable scratch space for BPETokenizer::encode_into(). Keep one per thread: the
+// buffers grow to the longest piece seen and are reused after that, so steady-state
+// encoding does not allocate. The optional segment cache is off until configured.
+struct EncodeContext {
+    std::vector<int32_t> nxt;                           // Linked list over a long piece (-1 = end, -2 = merged away)
+    std::vector<int32_t> prv;
+    std::vector<std::pair<int32_t, int32_t>> heap;      // (rank, position) min-heap
+    std::vector<SegmentSpan> spans;                     // Segments of the current lexer window
+    SegmentCache cache;
+};
+
 class BPETokenizer {
 public:
     struct MergeRule {
         uint32_t a, b, new_id;
     };
 
-    std::vector<std::string> vocab;
+    TokenVocab vocab;
     std::vector<MergeRule> merges;
     
-    // For inference (Encode) - lazy initialized
+    // For inference (Encode) - lazy initialized, layout chosen by inference_map_kind
     FastPairMap inference_map = FastPairMap(16);
+    SwissPairMap inference_swiss = SwissPairMap(16);
+    PairMapKind inference_map_kind = PAIR_MAP_LINEAR;
+    RankTable rank_table;
+    std::shared_ptr<const MappedFile> model_mapping;    // Backing memory of a v2 model (vocab, rank table arrays)
+    InferenceLookup inference_lookup = LOOKUP_AUTO;
+    bool rank_table_active = false;                     // Resolved from inference_lookup by build_inference_map()
+    bool inference_ready = false;
+    size_t heap_encode_threshold = 32;                  // Pieces this long use the O(n log n) heap encoder
+    EncodeContext encode_ctx;                           // Scratch for encode(); encode_ctx.cache.configure() enables caching
+    WordTable word_table;                               // Final IDs of frequent segments, consulted first by encode
+    size_t word_table_size = 0;                         // Top-N segments train() precomputes into word_table (0 = off);
+                                                        // v2 models store them and load() rebuilds the table
+
+    // Training knobs
+    uint32_t train_threads = 1;                         // Threads for pair counting and large merges (1 = serial)
+    bool use_indexed_heap = false;                      // Indexed heap instead of the lazy-deletion priority queue
+    bool record_merge_timings = false;                  // Fill train_stats.merge_timings
+    PairMapKind train_map_kind = PAIR_MAP_LINEAR;       // Pair statistics table layout
+    double index_compact_ratio = 0;                     // Compact IndexPool at this many nodes per live pair (0 = never)
+    static constexpr size_t MIN_SHARD_TOKENS = 1 << 16; // Smaller shards are not worth a thread
+    static constexpr size_t MIN_PARALLEL_POSITIONS = 1 << 14;  // Merges touching fewer positions stay serial
+    static constexpr size_t BATCH_TASK_BYTES = 1 << 16;        // Bytes of documents per encode_batch() task
+    static constexpr size_t PARALLEL_CHUNK_BYTES = 1 << 20;    // Target chunk size for encode_parallel()
+    static constexpr size_t MIN_COMPACT_NODES = 1 << 20;       // Pools below this are never compacted
     
+    // Counters from the last train() call
+    struct TrainStats {
+        uint32_t merges = 0;                            // Merges learned
+        uint64_t stale_pops = 0;                        // Queue entries popped and discarded
+        uint64_t stale_pops_avoided = 0;                // Indexed heap: in-place updates of a queued pair (each
+                                                        // would have left a stale entry in the lazy queue)
+        size_t queue_peak = 0;                          // Largest queue / heap size seen
+
+        // Time spent per merge phase, summed over all merges:
+        //   select   = popping the queue (stale pops included)
+        //   snapshot = walking the IndexPool list, sorting and deduplicating positions
+        //   apply    = rewriting links and updating neighbor pair counts
+        double select_seconds = 0, snapshot_seconds = 0, apply_seconds = 0;
+
+        struct MergeTiming {
+            uint32_t count;                             // Pair frequency when selected
+            uint32_t positions;                         // Unique positions in the snapshot
+            double select_seconds, snapshot_seconds, apply_seconds;
+        };
+        std::vector<MergeTiming> merge_timings;         // One per merge, if record_merge_timings
+
+        uint32_t compactions = 0;                       // IndexPool compactions run
+        uint64_t nodes_reclaimed = 0;                   // IndexPool nodes dropped by them
+        double compact_seconds = 0;                     // Time spent compacting (not in select / snapshot / apply)
+        size_t pool_peak = 0;                           // Largest IndexPool size (nodes)
+
+        size_t map_capacity = 0;                        // Pair map slots at the end of training
+        uint32_t map_resizes = 0;                       // Pair map rehashes (growth or tombstone purge)
+        FastPairMap::ProbeStats map_probes;             // Probe lengths of the final pair map
+    };
+    TrainStats train_stats;
+
     BPETokenizer() {
-        vocab.reserve(10000);
+        vocab.reserve(10000, 1 << 16);
         for (int i = 0; i < 256; i++) {
-            vocab.push_back(std::string(1, (char)i));
+            const char byte = static_cast<char>(i);
+            vocab.push_back(std::string_view(&byte, 1));
         }
     }
 
-    // MANUAL LEXER (no regex)
-    // This version is intentionally simple, fast, and byte-oriented.
-    // TODO: Replace this with a proper byte-level FSM that more closely matches
-    void lexical_split(const std::string& text,
-                    std::vector<uint32_t>& val,
-                    std::vector<int32_t>& next) {
+    // MANUAL LEXER (no regex)
+    // Appends one token per byte of `text` to val / next, linked within each segment (a
+    // maximal whitespace / alphabetic / numeric run, or a single other byte, as defined by
+    // BYTE_CLASSES and LEX_CONTINUES); next = -1 ends a segment.
+    void lexical_split(const std::string& text,
+                    std::vector<uint32_t>& val,
+                    std::vector<int32_t>& next) {
+
+        const size_t n = text.size();
+        const size_t base = val.size();
+        val.resize(base + n);
+        next.resize(base + n);
+
+        // Emit bytes and link every token to the one after it, in bulk
+        for (size_t k = 0; k < n; k++) {
+            val[base + k] = static_cast<unsigned char>(text[k]);
+            next[base + k] = static_cast<int32_t>(base + k + 1);
+        }
+
+        // Unlink the last token of each segment (whitespace / alphabetic / numeric run, or one other byte)
+        for_each_segment(text.data(), n, [&](size_t, size_t end) {
+            next[base + end - 1] = -1;
+        });
+    }
+
+    // Span output mode: appends one (offset, length) per segment, 8 bytes per segment
+    // instead of 8 per byte. encode_spans() and SegmentTable::add_spans() consume these.
+    void lexical_split(const std::string& text, std::vector<SegmentSpan>& spans) {
+        lex_spans(text.data(), text.size(), spans);
+    }
+
+
+    // train BPE tokenizer on full in-memory text.
+    // With `dedup`, the text is first collapsed into unique segments with occurrence
+    // counts and merges are learned over those (see train_segments()); otherwise every
+    // occurrence of every segment is linked into the token stream.
+    void train(const std::string& text, uint32_t target_vocab, uint32_t min_freq, bool dedup = false) {
+
+        if (target_vocab <= 256) return;                        // No merges possible below byte-level vocab
+
+        if (dedup) {
+            SegmentTable segments;
+            segments.add_text(text.data(), text.size());
+            train_segments(segments, target_vocab, min_freq);
+            return;
+        }
+        
+        size_t est_tokens = text.size();                        // one token per byte
+        std::vector<uint32_t> val;  val.reserve(est_tokens);    // Token values (byte IDs / merged IDs)
+        std::vector<int32_t>  next; next.reserve(est_tokens);   // Next pointer (linked list)
+
+        lexical_split(text, val, next);
+        learn_merges(val, next, {}, target_vocab, min_freq);
+
+        if (word_table_size > 0) build_word_table(text.data(), text.size(), word_table_size);
+    }
+
+    // train BPE tokenizer on a corpus file read in bounded chunks.
+    // Repeated segments are collapsed while reading, so peak memory tracks the unique
+    // content of the corpus (plus one chunk buffer), not the file size.
+    void train_stream(const std::string& path, uint32_t target_vocab, uint32_t min_freq,
+                      size_t chunk_size = size_t(64) << 20) {
+
+        if (target_vocab <= 256) return;
+
+        SegmentTable segments;
+        for_each_chunk(path, chunk_size, [&](const char* data, size_t len) {
+            segments.add_text(data, len);
+        });
+        train_segments(segments, target_vocab, min_freq);
+    }
+
+    // train on unique segments: each segment is laid out once in the token stream and
+    // every pair inside it is weighted by the segment's occurrence count.
+    void train_segments(const SegmentTable& segments, uint32_t target_vocab, uint32_t min_freq) {
+
+        if (target_vocab <= 256) return;
+
+        size_t total = 0;
+        for (const auto& r : segments.records) {
+            if (r.len >= 2) total += r.len;                     // Single-byte segments contribute no pairs
+        }
+        if (total >= static_cast<size_t>(INT32_MAX)) {          // Positions are int32_t
+            throw std::runtime_error("Too much unique content to train on (2^31 tokens max)");
+        }
+
+        std::vector<uint32_t> val;    val.reserve(total);
+        std::vector<int32_t>  next;   next.reserve(total);
+        std::vector<uint32_t> weight; weight.reserve(total);    // Occurrence count of the owning segment
+
+        for (const auto& r : segments.records) {
+            if (r.len < 2) continue;
+            const char* bytes = segments.arena.data() + r.offset;
+            const uint32_t w = r.count > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(r.count);
+
+            for (uint32_t k = 0; k < r.len; k++) {
+                val.push_back(static_cast<unsigned char>(bytes[k]));
+                next.push_back(k + 1 < r.len ? static_cast<int32_t>(val.size()) : -1);
+                weight.push_back(w);
+            }
+        }
+
+        learn_merges(val, next, weight, target_vocab, min_freq);
+
+        if (word_table_size > 0) build_word_table(segments, word_table_size);
+    }
+
+    // Precompute the final token IDs of the `top_n` most frequent segments (2+ bytes) of
+    // `segments` into word_table, ties going to the earlier segment. encode() then skips
+    // the merge loop for those without waiting for a cache to warm up.
+    void build_word_table(const SegmentTable& segments, size_t top_n) {
+        if (!inference_ready) {
+            build_inference_map();
+        }
+
+        std::vector<uint32_t> order;
+        for (size_t r = 0; r < segments.records.size(); r++) {
+            if (segments.records[r].len >= 2) order.push_back(static_cast<uint32_t>(r));
+        }
+        const size_t keep = std::min(top_n, order.size());
+        std::partial_sort(order.begin(), order.begin() + keep, order.end(), [&](uint32_t x, uint32_t y) {
+            const uint64_t cx = segments.records[x].count, cy = segments.records[y].count;
+            return cx != cy ? cx > cy : x < y;
+        });
+
+        std::vector<std::string_view> words(keep);
+        for (size_t k = 0; k < keep; k++) {
+            const SegmentTable::Record& rec = segments.records[order[k]];
+            words[k] = std::string_view(segments.arena.data() + rec.offset, rec.len);
+        }
+        build_word_table(words);
+    }
+
+    // Precompute the final token IDs of exactly these segments into word_table (this is
+    // how load() restores the table stored in a v2 model).
+    void build_word_table(const std::vector<std::string_view>& words) {
+        if (!inference_ready) {
+            build_inference_map();
+        }
+
+        word_table.clear();
+        EncodeContext ctx;
+        std::vector<uint32_t> piece;
+        for (const std::string_view word : words) {
+            piece.assign(reinterpret_cast<const unsigned char*>(word.data()),
+                         reinterpret_cast<const unsigned char*>(word.data()) + word.size());
+            piece.resize(merge_piece(piece.data(), piece.size(), ctx));
+            word_table.add(word.data(), word.size(), hash_bytes(word.data(), word.size()), piece.data(), piece.size());
+        }
+        word_table.build();
+    }
+
+    // Same, with segment frequencies taken from a sample corpus (e.g. after load()).
+    void build_word_table(const char* sample, size_t n, size_t top_n) {
+        SegmentTable segments;
+        segments.add_text(sample, n);
+        build_word_table(segments, top_n);
+    }
+
+    // Initial pair statistics over the whole token stream.
+    // With train_threads > 1 the stream is cut at segment boundaries into shards, each
+    // counted on its own thread with a private pair map and IndexPool. The shards are
+    // then folded into `stats` in shard order, inserting keys in first-occurrence order,
+    // which reproduces the serial table exactly, so the learned merges are bit-identical.
+    template <class PairMap>
+    void count_pairs(const std::vector<uint32_t>& val, const std::vector<int32_t>& next,
+                     const std::vector<int32_t>& prev, const uint32_t* w,
+                     PairMap& stats, IndexPool& index_pool) const {
+
+        const size_t n = val.size();
+        const size_t shard_count = std::min<size_t>(train_threads, n / MIN_SHARD_TOKENS);
 
-        const size_t n = text.size();
-        size_t i = 0;
+        if (shard_count <= 1) {
+            for (size_t i = 0; i < n; i++) {
 
-        while (i < n) {
-            const size_t start = i;
-            const unsigned char c = static_cast<unsigned char>(text[i]);
+                if (next[i] == -1) continue;                            // Skip segment boundaries
+                uint64_t key = pack(val[i], val[next[i]]);              // Encode adjacent token pair into a single 64-bit key
 
-            // 1. Whitespace segment
-            if (std::isspace(c)) {
-                while (i < n && std::isspace(static_cast<unsigned char>(text[i]))) {
-                    i++;
-                }
+                auto* entry = stats.insert(key);
+                entry->count = add_count(entry->count, w ? w[i] : 1);
+                index_pool.push(entry->head, i);
             }
-            // 2. Alphabetic segment (ASCII only)
-            else if (std::isalpha(c)) {
-                while (i < n && std::isalpha(static_cast<unsigned char>(text[i]))) {
-                    i++;
+            return;
+        }
+
+        struct Shard {
+            size_t begin, end;
+            PairMap map;
+            IndexPool pool;
+            std::vector<std::pair<uint64_t, int32_t>> order;           // (key, tail node) in first-occurrence order
+
+            Shard(size_t b, size_t e, size_t map_size)
+                : begin(b), end(e), map(map_size), pool((e - b) / 2) {}
+        };
+
+        std::vector<Shard> shards;
+        shards.reserve(shard_count);
+        size_t begin = 0;
+        for (size_t t = 1; t <= shard_count; t++) {
+            size_t end = (t == shard_count) ? n : n * t / shard_count;
+            while (end < n && prev[end] != -1) end++;                   // Move the cut to the next segment start
+            if (end <= begin) continue;
+            shards.emplace_back(begin, end, stats.table.size());
+            begin = end;
+        }
+
+        parallel_for(shards.size(), [&](size_t t) {
+            Shard& sh = shards[t];
+            for (size_t i = sh.begin; i < sh.end; i++) {
+                if (next[i] == -1) continue;
+                uint64_t key = pack(val[i], val[next[i]]);
+
+                auto* entry = sh.map.insert(key);
+                if (entry->head == -1) {                                // First occurrence in this shard
+                    sh.order.push_back({key, static_cast<int32_t>(sh.pool.pool.size())});
                 }
+
+                entry->count = add_count(entry->count, w ? w[i] : 1);
+                sh.pool.push(entry->head, i);
             }
-            // 3. Numeric segment
-            else if (std::isdigit(c)) {
-                while (i < n && std::isdigit(static_cast<unsigned char>(text[i]))) {
-                    i++;
-                }
+        });
+
+        // Concatenate the shard pools (node links rebased by each shard's offset).
+        std::vector<size_t> offset(shards.size() + 1, 0);
+        for (size_t t = 0; t < shards.size(); t++) {
+            offset[t + 1] = offset[t] + shards[t].pool.pool.size();
+        }
+        index_pool.pool.resize(offset.back());
+
+        parallel_for(shards.size(), [&](size_t t) {
+            const int32_t off = static_cast<int32_t>(offset[t]);
+            const auto& src = shards[t].pool.pool;
+            for (size_t k = 0; k < src.size(); k++) {
+                index_pool.pool[offset[t] + k] = {src[k].pos, src[k].next == -1 ? -1 : src[k].next + off};
             }
-            // 4. Punctuation / other bytes (single-byte segment)
-            else {
-                i++;
+        });
+
+        // Fold counts and splice each shard list in front of the global list.
+        for (size_t t = 0; t < shards.size(); t++) {
+            const int32_t off = static_cast<int32_t>(offset[t]);
+            for (const auto& kt : shards[t].order) {
+                const auto* local = shards[t].map.find(kt.first);
+                auto* entry = stats.insert(kt.first);
+
+                index_pool.pool[kt.second + off].next = entry->head;
+                entry->head = local->head + off;
+                entry->count = add_count(entry->count, local->count);
             }
+        }
+    }
 
-            // Emit bytes for this segment
-            const size_t segment_begin = val.size();
-            for (size_t k = start; k < i; k++) {
-                val.push_back(static_cast<unsigned char>(text[k]));
-                next.push_back(-1);  // temporarily mark as end
-            }
+    // Apply the merge (a, b) -> new_token at `pos` if the pair is still live there.
+    // Returns true if it did (one token fewer in the stream).
+    // Pair changes around it are reported in serial order through
+    //   dec(key, weight)      for neighbor pairs that disappear
+    //   inc(key, at, weight)  for new neighbor pairs (`at` is the position to index)
+    template <class Dec, class Inc>
+    static inline bool merge_at(int32_t pos, uint32_t a, uint32_t b, uint32_t new_token,
+                                std::vector<uint32_t>& val, std::vector<int32_t>& next,
+                                std::vector<int32_t>& prev, const uint32_t* w,
+                                Dec&& dec, Inc&& inc) {
+
+        if (pos < 0 || pos >= (int32_t)val.size()) return false;
+        if (val[pos] != a) return false;
+
+        int32_t next_pos = next[pos];
+        if (next_pos < 0 || next_pos >= (int32_t)val.size()) return false;
+        if (val[next_pos] != b) return false;
+
+        int32_t p  = prev[pos];
+        int32_t nn = next[next_pos];
+        const uint32_t wp = w ? w[pos] : 1;                     // All positions of a segment share its weight
+
+        // stale-position guards 
+        // If the links are no longer consistent, this position is stale.
+        // Skip it safely.
+        if (p != -1 && next[p] != pos) return false;
+        if (nn != -1 && prev[nn] != next_pos) return false;
+
+    #ifndef NDEBUG
+        if (p  != -1) assert(next[p] == pos);
+        if (nn != -1) assert(prev[nn] == next_pos);
+    #endif
+
+        // Decrement old neighboring pairs
+        if (p >= 0)  dec(pack(val[p], a), wp);
+        if (nn >= 0) dec(pack(b, val[nn]), wp);
+
+        val[pos] = new_token;
+        next[pos] = nn;
+        if (nn >= 0) {
+            prev[nn] = pos;
+        }
+
+    #ifndef NDEBUG
+        // Ensure removed token is no longer reachable
+        assert(next[pos] != pos);
+    #endif
+
+        // Increment new neighboring pairs
+        if (p >= 0)  inc(pack(val[p], new_token), p, wp);
+        if (nn >= 0) inc(pack(new_token, val[nn]), pos, wp);
+        return true;
+    }
+
+    // Neighbor pair changes of one worker during a parallel merge, summed per pair.
+    // `added` holds new pairs (count = summed weight, positions linked through `pool`),
+    // `removed` the pairs that disappeared (count = summed weight); both keep their keys
+    // in first-occurrence order so folding them back is deterministic.
+    struct MergeDelta {
+        FastPairMap added = FastPairMap(1 << 10);
+        FastPairMap removed = FastPairMap(1 << 10);
+        IndexPool pool = IndexPool(0);
+        std::vector<std::pair<uint64_t, int32_t>> added_order;     // (key, tail node in pool)
+        std::vector<uint64_t> removed_order;
+
+        void clear() {
+            added.clear();
+            removed.clear();
+            pool.pool.clear();
+            added_order.clear();
+            removed_order.clear();
+        }
+    };
 
-            // Link tokens within the segment
-            const size_t segment_end = val.size();
-            for (size_t p = segment_begin; p + 1 < segment_end; p++) {
-                next[p] = static_cast<int32_t>(p + 1);
+    // Apply one merge over a sorted position list on train_threads threads.
+    // The list is cut only where a segment starts between two neighboring positions, so
+    // no two threads ever touch the same segment. Each thread sums its neighbor pair
+    // changes per key into deltas[t]; the caller folds them back in thread order (see
+    // learn_merges_with()). Returns the number of positions merged.
+    size_t merge_positions_parallel(const std::vector<int32_t>& positions,
+                                  uint32_t a, uint32_t b, uint32_t new_token,
+                                  std::vector<uint32_t>& val, std::vector<int32_t>& next,
+                                  std::vector<int32_t>& prev, const uint32_t* w,
+                                  const std::vector<uint64_t>& seg_start,
+                                  std::vector<MergeDelta>& deltas) const {
+
+        const size_t m = positions.size();
+        std::vector<size_t> cuts = {0};
+        for (size_t t = 1; t < train_threads; t++) {
+            size_t j = std::max(m * t / train_threads, cuts.back() + 1);
+            while (j < m && !segment_start_between(seg_start, positions[j - 1], positions[j])) j++;
+            if (j >= m) break;
+            cuts.push_back(j);
+        }
+        cuts.push_back(m);
+
+        deltas.resize(cuts.size() - 1);
+
+        std::vector<size_t> applied(cuts.size() - 1, 0);
+        parallel_for(cuts.size() - 1, [&](size_t t) {
+            MergeDelta& d = deltas[t];
+            d.clear();
+            auto dec = [&d](uint64_t key, uint32_t wt) {
+                auto* e = d.removed.insert(key);
+                if (e->count == 0) d.removed_order.push_back(key);
+                e->count = add_count(e->count, wt);
+            };
+            auto inc = [&d](uint64_t key, int32_t at, uint32_t wt) {
+                auto* e = d.added.insert(key);
+                if (e->head == -1) d.added_order.push_back({key, static_cast<int32_t>(d.pool.pool.size())});
+                e->count = add_count(e->count, wt);
+                d.pool.push(e->head, at);
+            };
+            for (size_t k = cuts[t]; k < cuts[t + 1]; k++) {
+                applied[t] += merge_at(positions[k], a, b, new_token, val, next, prev, w, dec, inc);
             }
-            // next[segment_end - 1] stays -1 (segment boundary)
+        });
+
+        size_t total = 0;
+        for (size_t c : applied) total += c;
+        return total;
+    }
+
+    // Core merge loop over a lexed token stream.
+    // `weight` is either empty (every position counts once) or holds a per-position weight
+    // that is added to / removed from pair counts instead of 1.
+    void learn_merges(std::vector<uint32_t>& val, std::vector<int32_t>& next,
+                      const std::vector<uint32_t>& weight,
+                      uint32_t target_vocab, uint32_t min_freq) {
+
+        if (train_map_kind == PAIR_MAP_SWISS) {
+            learn_merges_with<SwissPairMap>(val, next, weight, target_vocab, min_freq);
+        } else {
+            learn_merges_with<FastPairMap>(val, next, weight, target_vocab, min_freq);
         }
     }
 
+    template <class PairMap>
+    void learn_merges_with(std::vector<uint32_t>& val, std::vector<int32_t>& next,
+                           const std::vector<uint32_t>& weight,
+                           uint32_t target_vocab, uint32_t min_freq) {
 
-    // train BPE tokenizer on full in-memory text (no streaming yet)
-    void train(const std::string& text, uint32_t target_vocab, uint32_t min_freq) {
+        if (target_vocab <= 256) return;
+        if (val.size() >= static_cast<size_t>(INT32_MAX)) {    // Positions are int32_t
+            throw std::runtime_error("Too much content to train on (2^31 tokens max)");
+        }
 
-        if (target_vocab <= 256) return;                        // No merges possible below byte-level vocab
-        
-        size_t est_tokens = text.size();                        // one token per byte
-        std::vector<uint32_t> val;  val.reserve(est_tokens);    // Token values (byte IDs / merged IDs)
-        std::vector<int32_t>  next; next.reserve(est_tokens);   // Next pointer (linked list)
-        std::vector<int32_t>  prev;                             // Prev pointer (built after lexing)
+        inference_ready = false;                                // New merges: encode must rebuild its lookup table
+        word_table.clear();
 
-        lexical_split(text, val, next);
+        const uint32_t* w = weight.empty() ? nullptr : weight.data();
+
+        std::vector<int32_t>  prev;                             // Prev pointer (built after lexing)
     
         size_t n = val.size();
         prev.resize(n, -1);                                     // -1 means no previous token (segment start)
@@ -172,78 +2178,192 @@ public:
         uint32_t map_size = 1;                                      // Choose hash table size as a power of two for fast masking, 
         while (map_size < target_vocab * 4) map_size <<= 1;         // oversized to reduce collisions during training
 
-        FastPairMap stats(map_size);                                // Hash map: (token_a, token_b) -> {frequency, list of positions}
+        PairMap stats(map_size);                                    // Hash map: (token_a, token_b) -> {frequency, list of positions}, grows on demand
         IndexPool index_pool(n / 2);                                // Memory pool storing all pair positions as intrusive linked lists
         std::priority_queue<std::pair<uint32_t, uint64_t>> queue;   // Max-heap: (pair_count, pair_key) to always pick the most frequent pair
 
-        for (size_t i = 0; i < n; i++) {
-
-            if (next[i] == -1) continue;                            // Skip segment boundaries
-            uint64_t key = pack(val[i], val[next[i]]);              // Encode adjacent token pair into a single 64-bit key
-
-            auto* entry = stats.get(key);
-            if (entry->key == UINT64_MAX) {
-                entry->key = key;
-                entry->count = 0;
-                entry->head = -1;
-            }
+        count_pairs(val, next, prev, w, stats, index_pool);         // Initial (a, b) -> count + positions
 
-            entry->count++;
-            index_pool.push(entry->head, i);
-        }
+        IndexedPairHeap<PairMap> heap(stats);                       // Alternative to `queue` (use_indexed_heap)
+        train_stats = TrainStats();
 
         size_t unique_pairs = 0;                        
                                                         
-        for (const auto& entry : stats.table) {
-            if (entry.key != UINT64_MAX && entry.count >= min_freq) {
-                queue.push({entry.count, entry.key});                   // Populate the priority queue with all frequent pairs,
+        for (size_t slot = 0; slot < stats.table.size(); slot++) {
+            const auto& entry = stats.table[slot];
+            if (PairMap::occupied(entry) && entry.count >= min_freq) {
+                if (use_indexed_heap) heap.update(static_cast<uint32_t>(slot), true);
+                else queue.push({entry.count, entry.key});              // Populate the priority queue with all frequent pairs,
                 unique_pairs++;                                         // so we can always select the most frequent pair to merge next.
             }
         }
         
         uint32_t current_vocab = 256;
-        uint32_t merges_to_do = target_vocab - 256;
-        uint32_t skipped = 0;
+
+        // Re-rank a pair after its count changed. The lazy queue gets a new entry (the old
+        // one goes stale); the indexed heap moves the existing one in place.
+        auto requeue = [&](typename PairMap::Entry* e) {
+            const uint32_t slot = static_cast<uint32_t>(e - stats.table.data());
+            if (heap.contains(slot)) train_stats.stale_pops_avoided++;
+            heap.update(slot, e->count >= min_freq);
+        };
+
+        // Neighbor pair updates reported by merge_at().
+        auto dec_pair = [&](uint64_t key, uint32_t wt) {
+            auto* e = stats.find(key);
+            if (e && e->count > 0) {
+                e->count -= std::min(e->count, wt);
+                if (use_indexed_heap) {
+                    requeue(e);
+                }
+                // Weighted streams re-queue the lowered count: with weights the counts skip
+                // values, so there is no older heap entry that happens to match it.
+                else if (w && e->count >= min_freq) {
+                    queue.push({e->count, e->key});
+                }
+            }
+        };
+
+        // stats.insert(), re-indexing the heap if the insert rehashed the map. A rehash
+        // moves entries even when the capacity stays (tombstone purge), so key on resizes.
+        auto insert_pair = [&](uint64_t key) {
+            const uint32_t resizes = stats.resizes;
+            auto* e = stats.insert(key);
+            if (use_indexed_heap && stats.resizes != resizes) {
+                heap.rebuild([&](const typename PairMap::Entry& x) { return x.count >= min_freq; });
+            }
+            return e;
+        };
+
+        auto inc_pair = [&](uint64_t key, int32_t at, uint32_t wt) {
+            auto* e = insert_pair(key);
+            e->count = add_count(e->count, wt);
+            index_pool.push(e->head, at);
+
+            if (use_indexed_heap) {
+                requeue(e);
+            } else if (e->count >= min_freq) {
+                queue.push({e->count, key});
+            }
+        };
+
+        // Fold the per-thread deltas of a parallel merge into stats, the queue and the
+        // IndexPool, thread by thread: new pairs first (each thread's position list is
+        // spliced in front of the global one), then removed pairs, one update per key.
+        // The result equals the serial loop's. Only the lazy queue without weights needs
+        // more than the final count: there a lowered count is never re-queued, so every
+        // level an increment passes through gets its entry, as the serial loop does.
+        auto fold_deltas = [&](const std::vector<MergeDelta>& deltas) {
+            for (const MergeDelta& d : deltas) {
+                const int32_t off = static_cast<int32_t>(index_pool.pool.size());
+                for (const auto& node : d.pool.pool) {
+                    index_pool.pool.push_back({node.pos, node.next == -1 ? -1 : node.next + off});
+                }
+
+                for (const auto& kt : d.added_order) {
+                    const auto* local = d.added.find(kt.first);
+                    auto* e = insert_pair(kt.first);
+                    index_pool.pool[kt.second + off].next = e->head;
+                    e->head = local->head + off;
+
+                    const uint64_t before = e->count;
+                    e->count = add_count(e->count, local->count);
+                    if (use_indexed_heap) {
+                        requeue(e);
+                    } else if (!w) {
+                        for (uint64_t c = std::max<uint64_t>(before + 1, min_freq); c <= e->count; c++) {
+                            queue.push({static_cast<uint32_t>(c), kt.first});
+                        }
+                    } else if (e->count >= min_freq) {
+                        queue.push({e->count, kt.first});
+                    }
+                }
+
+                for (uint64_t key : d.removed_order) dec_pair(key, d.removed.find(key)->count);
+            }
+        };
+
+        // Parallel merge state: segment-start bitmap used to cut position lists into
+        // ranges that never share a segment, and per-thread deltas.
+        std::vector<uint64_t> seg_start;
+        std::vector<MergeDelta> deltas;
+        if (train_threads > 1) {
+            seg_start.assign((n + 63) / 64, 0);
+            for (size_t i = 0; i < n; i++) {
+                if (prev[i] == -1) seg_start[i >> 6] |= uint64_t(1) << (i & 63);
+            }
+        }
         
+        // Scratch reused by every merge: position snapshot and radix sort buffer
+        std::vector<int32_t> positions;
+        std::vector<int32_t> sort_scratch;
+
+        // A pool node is live while its position still starts its pair. Once a position
+        // stops holding a pair it never holds it again (token ids only grow), so dropping
+        // dead nodes cannot change the merges.
+        auto live_at = [&](uint64_t key, int32_t pos) {
+            const auto ab = unpack(key);
+            if (val[pos] != ab.first) return false;
+            const int32_t nx = next[pos];
+            if (nx < 0 || val[nx] != ab.second) return false;
+            const int32_t p = prev[pos];
+            return p == -1 || next[p] == pos;                       // Not absorbed by an earlier merge
+        };
+        size_t live_pairs = index_pool.pool.size();                // One node per adjacent pair; each merge removes one pair
+
+        auto t_start = Clock::now();                                // Start of the current merge (selection included)
+
         while (current_vocab < target_vocab) {
 
-            if (queue.empty()) break;                                   // No merge candidates left
+            train_stats.queue_peak = std::max(train_stats.queue_peak,
+                                              use_indexed_heap ? heap.size() : queue.size());
+
+            typename PairMap::Entry* entry;
+            if (use_indexed_heap) {
+                if (heap.empty()) break;                                // No merge candidates left
+
+                const uint32_t slot = heap.top();
+                heap.remove(slot);
+                entry = &stats.table[slot];
+            } else {
+                if (queue.empty()) break;                               // No merge candidates left
             
-            auto top = queue.top();
-            queue.pop();
+                auto top = queue.top();
+                queue.pop();
 
-            uint32_t count = top.first;
-            uint64_t pair  = top.second;
+                uint32_t count = top.first;
+                uint64_t pair  = top.second;
 
-            auto* entry = stats.get(pair);
-            if (entry->key == UINT64_MAX) {
-                skipped++;
-                continue;
-            }
-            if (entry->count != count) {
-                skipped++;
-                continue;
+                entry = stats.find(pair);
+                if (!entry) {
+                    train_stats.stale_pops++;
+                    continue;
+                }
+                if (entry->count != count) {
+                    train_stats.stale_pops++;
+                    continue;
+                }
             }
             if (entry->count < min_freq) {
                 break;
             }
 
-            uint32_t merges_done = current_vocab - 256;
+            const uint64_t pair = entry->key;
             uint32_t new_token = current_vocab++;
             auto parts = unpack(pair);
             
-            vocab.push_back(vocab[parts.first] + vocab[parts.second]);      // Record merge rule and token string
+            vocab.push_merged(parts.first, parts.second);                   // Record merge rule and token string
             merges.push_back({parts.first, parts.second, new_token});
+            train_stats.merges++;
 
+            const uint32_t merge_count = entry->count;
             int32_t saved_head = entry->head;                               // Save inverted index head BEFORE invalidating
 
-            entry->key = UINT64_MAX;
-            entry->count = 0;
-            entry->head = -1;
-
+            stats.erase(entry);                                             // Tombstone: probe chains stay intact
 
             // Collect all positions where this pair occurs (snapshot)
-            std::vector<int32_t> positions;
+            const auto t_selected = Clock::now();
+            positions.clear();
             int32_t walk = saved_head;
 
             while (walk != -1 && walk < (int32_t)index_pool.pool.size()) {
@@ -251,103 +2371,55 @@ public:
                 walk = index_pool.pool[walk].next;
             }
 
-            std::sort(positions.begin(), positions.end());
+            sort_positions(positions, sort_scratch, n);
             positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
 
         #ifndef NDEBUG
             for (int32_t pos : positions) { assert(pos >= 0 && pos < (int32_t)val.size()); }
         #endif
 
+            const auto t_snapshot = Clock::now();
             
-            for (int32_t pos : positions) {
-
-                if (pos < 0 || pos >= (int32_t)val.size()) continue;
-                if (val[pos] != parts.first) continue;
-
-                int32_t next_pos = next[pos];
-                if (next_pos < 0 || next_pos >= (int32_t)val.size()) continue;
-                if (val[next_pos] != parts.second) continue;
-
-                int32_t p  = prev[pos];
-                int32_t nn = next[next_pos];
-
-                // stale-position guards 
-                // If the links are no longer consistent, this position is stale.
-                // Skip it safely.
-                if (p != -1 && next[p] != pos) continue;
-                if (nn != -1 && prev[nn] != next_pos) continue;
-
-            #ifndef NDEBUG
-                if (p  != -1) assert(next[p] == pos);
-                if (nn != -1) assert(prev[nn] == next_pos);
-            #endif
-
-                // Decrement old neighboring pairs
-                if (p >= 0) {
-                    auto* e = stats.get(pack(val[p], parts.first));
-                    if (e->key != UINT64_MAX && e->count > 0) {
-                        e->count--;
-            #ifndef NDEBUG
-                        assert(e->count >= 0);
-            #endif
-                    }
-                }
-
-                if (nn >= 0) {
-                    auto* e = stats.get(pack(parts.second, val[nn]));
-                    if (e->key != UINT64_MAX && e->count > 0) {
-                        e->count--;
-            #ifndef NDEBUG
-                        assert(e->count >= 0);
-            #endif
-                    }
-                }
-
-                val[pos] = new_token;
-                next[pos] = nn;
-                if (nn >= 0) {
-                    prev[nn] = pos;
-                }
-
-            #ifndef NDEBUG
-                // Ensure removed token is no longer reachable
-                assert(next[pos] != pos);
-            #endif
-
-                // Increment new neighboring pairs
-                if (p >= 0) {
-                    uint64_t key = pack(val[p], new_token);
-                    auto* e = stats.get(key);
-                    if (e->key == UINT64_MAX) {
-                        e->key = key;
-                        e->count = 0;
-                        e->head = -1;
-                    }
-                    e->count++;
-                    index_pool.push(e->head, p);
-
-                    if (e->count >= min_freq) {
-                        queue.push({e->count, key});
-                    }
+            if (train_threads > 1 && positions.size() >= MIN_PARALLEL_POSITIONS) {
+                // Rewrite disjoint segment ranges on worker threads, summing neighbor pair
+                // changes per key, then fold the sums back once per key.
+                live_pairs -= merge_positions_parallel(positions, parts.first, parts.second, new_token,
+                                                       val, next, prev, w, seg_start, deltas);
+                fold_deltas(deltas);
+            } else {
+                for (int32_t pos : positions) {
+                    live_pairs -= merge_at(pos, parts.first, parts.second, new_token, val, next, prev, w, dec_pair, inc_pair);
                 }
+            }
 
-                if (nn >= 0) {
-                    uint64_t key = pack(new_token, val[nn]);
-                    auto* e = stats.get(key);
-                    if (e->key == UINT64_MAX) {
-                        e->key = key;
-                        e->count = 0;
-                        e->head = -1;
-                    }
-                    e->count++;
-                    index_pool.push(e->head, pos);
-
-                    if (e->count >= min_freq) {
-                        queue.push({e->count, key});
-                    }
-                }
+            const auto t_applied = Clock::now();
+            const double select_s   = seconds(t_start, t_selected);
+            const double snapshot_s = seconds(t_selected, t_snapshot);
+            const double apply_s    = seconds(t_snapshot, t_applied);
+            train_stats.select_seconds   += select_s;
+            train_stats.snapshot_seconds += snapshot_s;
+            train_stats.apply_seconds    += apply_s;
+            if (record_merge_timings) {
+                train_stats.merge_timings.push_back({merge_count, static_cast<uint32_t>(positions.size()),
+                                                     select_s, snapshot_s, apply_s});
+            }
+            // Reclaim IndexPool nodes once the pool holds index_compact_ratio times more
+            // nodes than there are live pairs in the stream.
+            if (index_compact_ratio > 0 && index_pool.pool.size() >= MIN_COMPACT_NODES &&
+                index_pool.pool.size() > index_compact_ratio * live_pairs) {
+                const auto t_compact = Clock::now();
+                train_stats.pool_peak = std::max(train_stats.pool_peak, index_pool.pool.size());
+                train_stats.nodes_reclaimed += index_pool.compact(stats, live_at);
+                train_stats.compactions++;
+                train_stats.compact_seconds += seconds(t_compact, Clock::now());
             }
+
+            t_start = Clock::now();
         }
+        train_stats.pool_peak = std::max(train_stats.pool_peak, index_pool.pool.size());
+        train_stats.map_capacity = stats.table.size();
+        train_stats.map_resizes = stats.resizes;
+        train_stats.map_probes = stats.probe_stats();
     }
 
     // Binary layout (little-endian, same-arch) for saving tokenizer to disk in binary format:
@@ -355,38 +2427,115 @@ public:
     //   [vocab_size:u32][merge_count:u32]
     //   [MergeRule x merge_count]
     //   [ [token_len:u32][token_bytes] x vocab_size ]
-    void save(const std::string& path) const {
-        std::ofstream out(path, std::ios::binary);
-        if (!out) {
-            throw std::runtime_error("Cannot open file for writing");
+    void save(const std::string& path, uint32_t version = BPE_VERSION) const {
+        if (version == BPE_VERSION_MAPPED) {
+            save_mapped(path);
+            return;
+        }
+        if (version != BPE_VERSION) {
+            throw std::runtime_error("Unsupported file version");
         }
 
-        out.write(reinterpret_cast<const char*>(&BPE_MAGIC), sizeof(BPE_MAGIC));
-        out.write(reinterpret_cast<const char*>(&BPE_VERSION), sizeof(BPE_VERSION));
+        write_file_replacing(path, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&BPE_MAGIC), sizeof(BPE_MAGIC));
+            out.write(reinterpret_cast<const char*>(&BPE_VERSION), sizeof(BPE_VERSION));
 
-        uint32_t vocab_size  = static_cast<uint32_t>(vocab.size());
-        uint32_t merge_count = static_cast<uint32_t>(merges.size());
+            uint32_t vocab_size  = static_cast<uint32_t>(vocab.size());
+            uint32_t merge_count = static_cast<uint32_t>(merges.size());
 
-        out.write(reinterpret_cast<const char*>(&vocab_size), sizeof(vocab_size));
-        out.write(reinterpret_cast<const char*>(&merge_count), sizeof(merge_count));
+            out.write(reinterpret_cast<const char*>(&vocab_size), sizeof(vocab_size));
+            out.write(reinterpret_cast<const char*>(&merge_count), sizeof(merge_count));
 
         
-        for (const auto& m : merges) {
-            out.write(reinterpret_cast<const char*>(&m), sizeof(m));        // Each MergeRule is written as raw bytes (POD, fixed-size).
-        }
+            for (const auto& m : merges) {
+                out.write(reinterpret_cast<const char*>(&m), sizeof(m));    // Each MergeRule is written as raw bytes (POD, fixed-size).
+            }
         
-        for (const auto& token : vocab) {
-            uint32_t len = static_cast<uint32_t>(token.size());
-            out.write(reinterpret_cast<const char*>(&len), sizeof(len));
-            out.write(token.data(), len);
+            for (size_t i = 0; i < vocab.size(); i++) {
+                const std::string_view token = vocab[i];
+                uint32_t len = static_cast<uint32_t>(token.size());
+                out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+                out.write(token.data(), len);
+            }
+        });
+    }
+
+    // Write the v2 (memory-mappable) format: see ModelHeaderV2. The rank table is stored
+    // prebuilt only when encode would look ranks up in it (use_rank_table()), so load() has
+    // nothing to rebuild there; larger vocabs hash, and their pair map is built at load.
+    void save_mapped(const std::string& path) const {
+        ModelHeaderV2 h = {};
+        h.magic = BPE_MAGIC;
+        h.version = BPE_VERSION_MAPPED;
+        h.vocab_size = static_cast<uint32_t>(vocab.size());
+        h.merge_count = static_cast<uint32_t>(merges.size());
+
+        RankTable table;
+        const bool with_table = use_rank_table() && vocab.size() <= RankTable::MAX_VOCAB;
+        if (with_table) table.build(merges, vocab.size());
+
+        uint64_t at = align_up(sizeof(h), MODEL_ALIGN);                  // Lay out the sections
+        auto place = [&](uint64_t bytes) {
+            const uint64_t start = at;
+            at = align_up(at + bytes, MODEL_ALIGN);
+            return start;
+        };
+        h.merges_at = place(merges.size() * sizeof(MergeRule));
+        h.offsets_at = place((vocab.size() + 1) * sizeof(uint32_t));
+        h.bytes_size = vocab.byte_size();
+        h.bytes_at = place(h.bytes_size + TOKEN_PAD);                   // Keep the decode padding
+        if (with_table) {
+            h.rank_entries = table.rights.size();
+            h.byte_ranks_at = place(table.byte_ranks.size() * sizeof(int32_t));
+            h.rank_offsets_at = place(table.offsets.size() * sizeof(uint32_t));
+            h.rights_at = place(table.rights.size() * sizeof(uint16_t));
+            h.ranks_at = place(table.ranks.size() * sizeof(int32_t));
         }
 
-        if (!out) {
-            throw std::runtime_error("Error occurred while writing tokenizer file");
+        std::vector<uint32_t> word_offsets(1, 0);                       // Word table segments, back to back
+        std::string word_bytes;
+        for (size_t k = 0; k < word_table.key_count(); k++) {
+            word_bytes.append(word_table.key(k));
+            word_offsets.push_back(static_cast<uint32_t>(word_bytes.size()));
         }
+        if (word_table.key_count() > 0) {
+            h.word_count = word_table.key_count();
+            h.word_offsets_at = place(word_offsets.size() * sizeof(uint32_t));
+            h.word_bytes_at = place(word_bytes.size());
+        }
+
+        write_file_replacing(path, [&](std::ofstream& out) {
+            uint64_t written = 0;
+            auto write_at = [&](uint64_t pos, const void* data, size_t bytes) {
+                static const char zeros[MODEL_ALIGN] = {};
+                while (written < pos) {                                 // Alignment padding
+                    const size_t pad = std::min<uint64_t>(pos - written, MODEL_ALIGN);
+                    out.write(zeros, pad);
+                    written += pad;
+                }
+                out.write(static_cast<const char*>(data), bytes);
+                written += bytes;
+            };
+
+            write_at(0, &h, sizeof(h));
+            write_at(h.merges_at, merges.data(), merges.size() * sizeof(MergeRule));
+            write_at(h.offsets_at, vocab.offset_data(), (vocab.size() + 1) * sizeof(uint32_t));
+            write_at(h.bytes_at, vocab.byte_data(), vocab.byte_size() + TOKEN_PAD);
+            if (with_table) {
+                write_at(h.byte_ranks_at, table.byte_ranks.data(), table.byte_ranks.size() * sizeof(int32_t));
+                write_at(h.rank_offsets_at, table.offsets.data(), table.offsets.size() * sizeof(uint32_t));
+                write_at(h.rights_at, table.rights.data(), table.rights.size() * sizeof(uint16_t));
+                write_at(h.ranks_at, table.ranks.data(), table.ranks.size() * sizeof(int32_t));
+            }
+            if (h.word_count > 0) {
+                write_at(h.word_offsets_at, word_offsets.data(), word_offsets.size() * sizeof(uint32_t));
+                write_at(h.word_bytes_at, word_bytes.data(), word_bytes.size());
+            }
+            write_at(at, nullptr, 0);                                   // Pad the tail to MODEL_ALIGN
+        });
     }
 
-    // Load tokenizer from a binary file previously written by `save()`.
+    // Load tokenizer from a binary file previously written by `save()` (v1 or v2).
     void load(const std::string& path) {
         std::ifstream in(path, std::ios::binary);
         if (!in) {
@@ -400,6 +2549,11 @@ public:
         if (magic != BPE_MAGIC) {
             throw std::runtime_error("Invalid file format (bad magic number)");
         }
+        if (version == BPE_VERSION_MAPPED) {
+            in.close();
+            load_mapped(path);
+            return;
+        }
         if (version != BPE_VERSION) {
             throw std::runtime_error("Unsupported file version");
         }
@@ -417,7 +2571,7 @@ public:
                 ms * sizeof(MergeRule));
 
         vocab.clear();
-        vocab.reserve(vs);
+        vocab.reserve(vs, size_t(vs) * 8);
 
         for (uint32_t i = 0; i < vs; i++) {
             uint32_t len;
@@ -427,138 +2581,535 @@ public:
                 throw std::runtime_error("Suspicious token length");
             }
 
-            std::string token(len, '\0');
-            in.read(&token[0], len);
-            vocab.push_back(std::move(token));
+            in.read(vocab.add(len), len);
         }
 
         if (!in) {
             throw std::runtime_error("File read error");
         }
+        check_merges();
 
         // Build inference structures - Precompute fast lookup tables for encoding.
+        word_table.clear();
+        model_mapping.reset();
         build_inference_map();
     }
+
+    // Encode uses merge tokens as indexes into the vocab and the lookup tables, so a loaded
+    // model must only name tokens it has.
+    void check_merges() const {
+        const size_t vocab_size = vocab.size();
+        for (const auto& m : merges) {
+            if (m.a >= vocab_size || m.b >= vocab_size || m.new_id >= vocab_size) {
+                throw std::runtime_error("Corrupt model file (bad merge rule)");
+            }
+        }
+    }
+
+    // Load a v2 model by mapping it. The token arena and, when encode uses it (see
+    // use_rank_table()), the stored rank table are used in place, and processes mapping the
+    // same file share its page-cache copy. The merge rules are copied out.
+    void load_mapped(const std::string& path) {
+        auto file = std::make_shared<const MappedFile>(path);
+        const char* base = file->data();
+        const uint64_t size = file->size();
+
+        ModelHeaderV2 h;
+        if (size < sizeof(h)) {
+            throw std::runtime_error("File read error");
+        }
+        std::memcpy(&h, base, sizeof(h));
+        if (h.magic != BPE_MAGIC) {
+            throw std::runtime_error("Invalid file format (bad magic number)");
+        }
+        if (h.version != BPE_VERSION_MAPPED) {
+            throw std::runtime_error("Unsupported file version");
+        }
+        if (h.vocab_size > 1'000'000 || h.merge_count > 1'000'000) {
+            throw std::runtime_error("Suspicious vocab or merge count");
+        }
+
+        auto section = [&](uint64_t at, uint64_t bytes) {               // Bounds- and alignment-checked pointer
+            if (at % MODEL_ALIGN != 0 || at > size || bytes > size - at) {
+                throw std::runtime_error("Corrupt model file (bad section)");
+            }
+            return base + at;
+        };
+        const auto* rules = reinterpret_cast<const MergeRule*>(section(h.merges_at, uint64_t(h.merge_count) * sizeof(MergeRule)));
+        const auto* token_offsets = reinterpret_cast<const uint32_t*>(section(h.offsets_at, (uint64_t(h.vocab_size) + 1) * sizeof(uint32_t)));
+        const char* token_bytes = section(h.bytes_at, h.bytes_size);
+        const bool padded = h.bytes_size + TOKEN_PAD <= size - h.bytes_at;
+        for (uint32_t i = 0; i < h.vocab_size; i++) {
+            if (token_offsets[i] > token_offsets[i + 1] || token_offsets[i + 1] > h.bytes_size) {
+                throw std::runtime_error("Corrupt model file (bad token offsets)");
+            }
+        }
+
+        std::vector<std::string_view> words;
+        if (h.word_count > 0) {
+            if (h.word_count > 1'000'000) {
+                throw std::runtime_error("Suspicious word table size");
+            }
+            const auto* word_offsets = reinterpret_cast<const uint32_t*>(section(h.word_offsets_at, (h.word_count + 1) * sizeof(uint32_t)));
+            const char* word_bytes = section(h.word_bytes_at, word_offsets[h.word_count]);
+            for (uint64_t k = 0; k < h.word_count; k++) {
+                if (word_offsets[k] > word_offsets[k + 1] || word_offsets[k + 1] > word_offsets[h.word_count]) {
+                    throw std::runtime_error("Corrupt model file (bad word table offsets)");
+                }
+                words.emplace_back(word_bytes + word_offsets[k], word_offsets[k + 1] - word_offsets[k]);
+            }
+        }
+
+        merges.assign(rules, rules + h.merge_count);
+        if (padded) vocab.attach(token_bytes, token_offsets, h.vocab_size);    // Served from the mapping
+        else        vocab.assign(token_bytes, token_offsets, h.vocab_size);
+        check_merges();
+
+        word_table.clear();
+        model_mapping = file;
+
+        if (h.byte_ranks_at != 0 && h.vocab_size > RankTable::MAX_VOCAB) {
+            throw std::runtime_error("Corrupt model file (rank table stored for too large a vocab)");
+        }
+        // At most one entry per merge; bounding it first also keeps the section sizes below from wrapping
+        if (h.byte_ranks_at != 0 && h.rank_entries > h.merge_count) {
+            throw std::runtime_error("Corrupt model file (bad rank table size)");
+        }
+        if (h.byte_ranks_at == 0 || !use_rank_table()) {
+            build_inference_map();
+            if (!words.empty()) build_word_table(words);
+            return;
+        }
+
+        RankTable::View view;
+        view.byte_ranks = reinterpret_cast<const int32_t*>(section(h.byte_ranks_at, 256 * 256 * sizeof(int32_t)));
+        view.offsets = reinterpret_cast<const uint32_t*>(section(h.rank_offsets_at, (uint64_t(h.vocab_size) + 1) * sizeof(uint32_t)));
+        view.rights = reinterpret_cast<const uint16_t*>(section(h.rights_at, h.rank_entries * sizeof(uint16_t)));
+        view.ranks = reinterpret_cast<const int32_t*>(section(h.ranks_at, h.rank_entries * sizeof(int32_t)));
+        view.offset_count = uint64_t(h.vocab_size) + 1;
+        view.entry_count = h.rank_entries;
+        for (uint32_t i = 0; i < h.vocab_size; i++) {
+            if (view.offsets[i] > view.offsets[i + 1] || view.offsets[i + 1] > h.rank_entries) {
+                throw std::runtime_error("Corrupt model file (bad rank table offsets)");
+            }
+        }
+        // Ranks index `merges` during encode, so every stored value is checked once here
+        auto valid_rank = [&](int32_t r) { return r >= -1 && r < static_cast<int64_t>(h.merge_count); };
+        for (size_t k = 0; k < 256 * 256; k++) {
+            if (!valid_rank(view.byte_ranks[k])) {
+                throw std::runtime_error("Corrupt model file (bad rank table entry)");
+            }
+        }
+        for (uint64_t k = 0; k < h.rank_entries; k++) {
+            if (!valid_rank(view.ranks[k]) || view.rights[k] >= h.vocab_size) {
+                throw std::runtime_error("Corrupt model file (bad rank table entry)");
+            }
+        }
+
+        encode_ctx.cache.clear();
+        inference_map = FastPairMap(16);
+        inference_swiss = SwissPairMap(16);
+        rank_table.attach(view);
+        rank_table_active = true;
+        inference_ready = true;
+        if (!words.empty()) build_word_table(words);
+    }
     
     // Build fast lookup table for inference from learned merge rules.
     // Maps (a, b) token pairs -> merge rank (stored in Entry::head). This allows O(1) average-time lookup during encoding.
+    // Small vocabs get a direct-indexed RankTable instead (see use_rank_table()).
     void build_inference_map() {
+        encode_ctx.cache.clear();                                       // Cached IDs came from the old merges
+
         uint32_t map_size = 1;
         while (map_size < merges.size() * 2) {
             map_size <<= 1;
         }
         
-        inference_map.table.assign(map_size, {UINT64_MAX, 0, -1});      // Initialize hash table: UINT64_MAX marks empty slots.
-        inference_map.mask = map_size - 1;
+        rank_table_active = use_rank_table();
+        if (rank_table_active) {
+            if (vocab.size() > RankTable::MAX_VOCAB) {
+                throw std::runtime_error("Vocab too large for the rank table");
+            }
+            rank_table.build(merges, vocab.size());                     // No hashing at all for small vocabs
+            inference_map = FastPairMap(16);
+            inference_swiss = SwissPairMap(16);
+            inference_ready = true;
+            return;
+        }
+        rank_table = RankTable();
+
+        inference_map = FastPairMap(inference_map_kind == PAIR_MAP_LINEAR ? map_size : 16);    // Sized for load <= 0.5,
+        inference_swiss = SwissPairMap(inference_map_kind == PAIR_MAP_SWISS ? map_size : 16);   // never grows here
 
         for (size_t i = 0; i < merges.size(); i++) {                    // Insert all merge rules into the hash table.
             uint64_t key = pack(merges[i].a, merges[i].b);              // The index 'i' is the merge rank (lower = higher priority).
-            
-            uint32_t idx =
-                (key * 0x9E3779B97F4A7C15ULL) & inference_map.mask;     // Multiplicative hash + linear probing
-
-            while (true) {
-                if (inference_map.table[idx].key == UINT64_MAX) {
-                    inference_map.table[idx].key = key;
-                    inference_map.table[idx].head = static_cast<int32_t>(i);
-                    break;
-                }
-                idx = (idx + 1) & inference_map.mask;
-            }
+            if (inference_map_kind == PAIR_MAP_SWISS) inference_swiss.insert(key)->head = static_cast<int32_t>(i);
+            else                                      inference_map.insert(key)->head = static_cast<int32_t>(i);
         }
+        inference_ready = true;
+    }
+
+    // Whether encode looks ranks up in the RankTable rather than a pair map.
+    bool use_rank_table() const {
+        return inference_lookup == LOOKUP_RANK_TABLE ||
+               (inference_lookup == LOOKUP_AUTO && vocab.size() <= RankTable::AUTO_MAX_VOCAB);
+    }
+
+    // Merge rank of the pair (a, b), or -1 if no merge rule applies.
+    inline int32_t merge_rank(uint32_t a, uint32_t b) const {
+        if (rank_table_active) return rank_table.rank(a, b);
+        const uint64_t key = pack(a, b);
+        const FastPairMap::Entry* e = (inference_map_kind == PAIR_MAP_SWISS) ? inference_swiss.find(key)
+                                                                             : inference_map.find(key);
+        return e ? e->head : -1;
     }
 
 
     // Encode a single contiguous token segment using learned BPE merge rules.
     // Repeatedly applies the highest-priority (lowest-rank) merge until no more apply.
-    std::vector<uint32_t> byte_pair_encode_piece(const std::vector<uint32_t>& piece) {
-
-        if (piece.size() < 2) return piece;
+    std::vector<uint32_t> byte_pair_encode_piece(const std::vector<uint32_t>& piece) const {
+        EncodeContext ctx;
+        std::vector<uint32_t> work = piece;
+        work.resize(merge_piece(work.data(), work.size(), ctx));
+        return work;
+    }
 
+    // byte_pair_encode_piece() forced onto the heap path, whatever the piece length.
+    std::vector<uint32_t> byte_pair_encode_piece_heap(const std::vector<uint32_t>& piece) const {
+        EncodeContext ctx;
         std::vector<uint32_t> work = piece;
+        work.resize(merge_piece_heap(work.data(), work.size(), ctx));
+        return work;
+    }
+
+    // Applies merges to tok[0, n) in place and returns the merged length.
+    size_t merge_piece(uint32_t* tok, size_t n, EncodeContext& ctx) const {
 
-        while (work.size() >= 2) {
+        if (n < 2) return n;
+        if (n >= heap_encode_threshold) return merge_piece_heap(tok, n, ctx);
+
+        while (n >= 2) {
             int32_t best_rank = INT32_MAX;
             size_t best_i = 0;
 
-            for (size_t i = 0; i + 1 < work.size(); i++) {
-                uint64_t key = pack(work[i], work[i + 1]);
-                auto* e = inference_map.get(key);
+            for (size_t i = 0; i + 1 < n; i++) {
+                int32_t rank = merge_rank(tok[i], tok[i + 1]);
 
-                if (e->key != UINT64_MAX) {
-                    int32_t rank = e->head;  
-                    if (rank < best_rank) {
-                        best_rank = rank;
-                        best_i = i;
-                    }
+                if (rank >= 0 && rank < best_rank) {
+                    best_rank = rank;
+                    best_i = i;
                 }
             }
 
             if (best_rank == INT32_MAX) break;
 
-            uint32_t new_token = merges[best_rank].new_id;
-            work[best_i] = new_token;
-            work.erase(work.begin() + best_i + 1);
+            tok[best_i] = merges[best_rank].new_id;
+            std::memmove(tok + best_i + 1, tok + best_i + 2, (n - best_i - 2) * sizeof(uint32_t));
+            n--;
         }
 
-        return work;
+        return n;
+    }
+
+    // Same result as the rescanning loop in merge_piece(), in O(n log n) instead of O(n^2).
+    // The piece becomes a doubly linked list and every adjacent pair with a merge rule sits
+    // in a min-heap keyed by (rank, position). Positions keep their left-to-right order,
+    // so ties on rank resolve to the leftmost pair, as in the rescanning loop. A popped
+    // entry is stale if its left token died or the pair there no longer has that rank.
+    size_t merge_piece_heap(uint32_t* tok, size_t n, EncodeContext& ctx) const {
+
+        if (n < 2) return n;
+
+        auto& nxt = ctx.nxt;
+        auto& prv = ctx.prv;
+        auto& heap = ctx.heap;
+        nxt.resize(n);
+        prv.resize(n);
+        heap.clear();
+        for (size_t i = 0; i < n; i++) {
+            nxt[i] = (i + 1 < n) ? static_cast<int32_t>(i + 1) : -1;
+            prv[i] = static_cast<int32_t>(i) - 1;
+        }
+
+        const auto later = std::greater<std::pair<int32_t, int32_t>>();
+        auto push_pair = [&](int32_t i) {
+            if (i < 0 || nxt[i] < 0) return;
+            const int32_t rank = merge_rank(tok[i], tok[nxt[i]]);
+            if (rank < 0) return;
+            heap.push_back({rank, i});
+            std::push_heap(heap.begin(), heap.end(), later);
+        };
+        for (size_t i = 0; i + 1 < n; i++) push_pair(static_cast<int32_t>(i));
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            const auto [rank, i] = heap.back();
+            heap.pop_back();
+
+            if (nxt[i] < 0) continue;                                   // Merged away, or last token
+            if (merge_rank(tok[i], tok[nxt[i]]) != rank) continue;     // Stale: pair changed since the push
+
+            const int32_t j = nxt[i];                                   // Absorb the right token
+            tok[i] = merges[rank].new_id;
+            nxt[i] = nxt[j];
+            nxt[j] = -2;
+            if (nxt[i] >= 0) prv[nxt[i]] = i;
+
+            push_pair(prv[i]);                                          // New pairs on both sides
+            push_pair(i);
+        }
+
+        size_t m = 0;                                                   // Compact survivors to the front
+        for (int32_t i = 0; i >= 0; i = nxt[i]) tok[m++] = tok[i];
+        return m;
+    }
+
+    // Allocation-free encode: writes the token IDs of text[0, n) to out[0, capacity) and
+    // returns how many were written. Segments are merged in place in `out`, so the worst
+    // case needs capacity n; throws if a segment does not fit. Requires the inference
+    // tables (load() builds them; call build_inference_map() after train()). If ctx.cache
+    // is configured, short segments are looked up there before merging, after the
+    // precomputed word_table (see build_word_table()). The input is lexed into ctx.spans a
+    // window at a time and each window is handed to encode_spans().
+    size_t encode_into(const char* text, size_t n, EncodeContext& ctx, uint32_t* out, size_t capacity) const {
+        if (!inference_ready) {
+            throw std::runtime_error("Inference tables not built");
+        }
+
+        size_t written = 0;
+        for_each_span_window(text, n, ctx.spans, [&](const char* window, const SegmentSpan* spans, size_t count) {
+            written += encode_spans(window, spans, count, ctx, out + written, capacity - written);
+        });
+        return written;
     }
 
+    // encode_into() over segments already lexed into spans (see lex_spans()); `text` is the
+    // buffer the span offsets are relative to.
+    size_t encode_spans(const char* text, const SegmentSpan* spans, size_t span_count, EncodeContext& ctx,
+                        uint32_t* out, size_t capacity) const {
+        if (!inference_ready) {
+            throw std::runtime_error("Inference tables not built");
+        }
+
+        size_t written = 0;
+        for (size_t s = 0; s < span_count; s++) {
+            const size_t start = spans[s].offset;
+            const size_t len = spans[s].length;
+            if (len > capacity - written) {
+                throw std::runtime_error("Encode output buffer too small");
+            }
+
+            uint32_t* piece = out + written;
+            const bool known = word_table.size() > 0 && len >= 2;
+            const bool cacheable = ctx.cache.capacity() > 0 && len >= 2 && len <= SegmentCache::MAX_BYTES;
+            const uint64_t hash = (known || cacheable) ? hash_bytes(text + start, len) : 0;
+            size_t count = 0;
+            const uint32_t* ids = known ? word_table.find(text + start, len, hash, count) : nullptr;
+            if (!ids && cacheable) ids = ctx.cache.find(text + start, len, hash, count);
+            if (ids) {
+                std::memcpy(piece, ids, count * sizeof(uint32_t));
+                written += count;
+                continue;
+            }
+
+            for (size_t k = 0; k < len; k++) piece[k] = static_cast<unsigned char>(text[start + k]);
+            count = merge_piece(piece, len, ctx);
+            if (cacheable) ctx.cache.insert(text + start, len, hash, piece, count);
+            written += count;
+        }
+        return written;
+    }
 
     // Encode input text into BPE token IDs using trained merge rules.
+    // Single pass: each segment is recognized and merged straight from the input bytes
+    // (see encode_into()), with no whole-input ids / next arrays in between.
     std::vector<uint32_t> encode(const std::string& text) {
 
         // Lazily build inference lookup table if not already initialized.
         // This is needed after load() or train().
-        if (inference_map.table[0].key == UINT64_MAX && !merges.empty()) {
+        if (!inference_ready) {
+            build_inference_map();
+        }
+
+        std::vector<uint32_t> result(text.size());         // Upper bound: no more tokens than bytes
+        result.resize(encode_into(text.data(), text.size(), encode_ctx, result.data(), result.size()));
+        return result;
+    }
+
+    // Encode many documents on `threads` threads (work stealing over groups of documents).
+    // The inference tables and word_table are shared read-only; every worker has its own
+    // EncodeContext, with a segment cache configured like encode_ctx's.
+    EncodedBatch encode_batch(const std::vector<std::string>& docs, size_t threads = 1) {
+        return encode_pieces(docs.size(), [&](size_t d) {
+            return std::make_pair(docs[d].data(), docs[d].size());
+        }, threads);
+    }
+
+    // Encode one large text on `threads` threads. The text is cut into chunks at segment
+    // boundaries (merges never cross those), so the result equals encode(text) exactly.
+    std::vector<uint32_t> encode_parallel(const std::string& text, size_t threads) {
+        if (threads <= 1) return encode(text);
+        return encode_parallel(text.data(), text.size(), threads);
+    }
+
+    std::vector<uint32_t> encode_parallel(const char* text, size_t n, size_t threads) {
+        const size_t chunks = std::max<size_t>(threads, n / PARALLEL_CHUNK_BYTES);
+        std::vector<size_t> cuts(chunks + 1, n);
+        cuts[0] = 0;
+        for (size_t k = 1; k < chunks; k++) {
+            cuts[k] = std::max(cuts[k - 1], last_segment_start(text, n * k / chunks));
+        }
+
+        return encode_pieces(chunks, [&](size_t k) {
+            return std::make_pair(text + cuts[k], cuts[k + 1] - cuts[k]);
+        }, threads).ids;
+    }
+
+    struct EncodeFileResult {
+        uint64_t bytes = 0;
+        uint64_t tokens = 0;
+    };
+
+    // Encode a file to packed little-endian token IDs of `id_bytes` (2 or 4) bytes each.
+    // The input is read in chunks of about `chunk_size` that end on segment boundaries
+    // (see for_each_chunk()), so memory stays bounded by the chunk size and the output is
+    // the same as encoding the whole file at once.
+    EncodeFileResult encode_file(const std::string& in_path, const std::string& out_path, size_t id_bytes,
+                                 size_t chunk_size = size_t(16) << 20, size_t threads = 1) {
+        if (id_bytes != 2 && id_bytes != 4) {
+            throw std::runtime_error("Token ID width must be 2 or 4 bytes");
+        }
+        if (id_bytes == 2 && vocab.size() > 65536) {
+            throw std::runtime_error("Vocab too large for 16-bit token IDs");
+        }
+        if (!inference_ready) {
             build_inference_map();
         }
 
+        std::ofstream out(out_path, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Cannot open output file");
+        }
+
+        EncodeFileResult result;
         std::vector<uint32_t> ids;
-        std::vector<int32_t> next_arr;
-        lexical_split(text, ids, next_arr);
+        std::vector<uint16_t> narrow;
+        for_each_chunk(in_path, chunk_size, [&](const char* data, size_t len) {
+            if (threads > 1) {
+                ids = encode_parallel(data, len, threads);
+            } else {
+                if (ids.size() < len) ids.resize(len);                  // Reused across chunks
+                ids.resize(encode_into(data, len, encode_ctx, ids.data(), len));
+            }
+
+            if (id_bytes == 2) {
+                narrow.assign(ids.begin(), ids.end());
+                out.write(reinterpret_cast<const char*>(narrow.data()), narrow.size() * sizeof(uint16_t));
+            } else {
+                out.write(reinterpret_cast<const char*>(ids.data()), ids.size() * sizeof(uint32_t));
+            }
+            if (!out) {
+                throw std::runtime_error("File write error");
+            }
 
-        std::vector<uint32_t> result;
-        result.reserve(ids.size());                         // Upper bound: no more tokens than bytes
+            result.bytes += len;
+            result.tokens += ids.size();
+        });
+        return result;
+    }
 
-        std::vector<uint32_t> segment;
-        segment.reserve(32);                                // Typical segments are small; avoids frequent reallocs
+    // Encodes `count` independent inputs, piece(i) -> (data, len), on `threads` threads.
+    // Pieces are grouped into tasks of ~BATCH_TASK_BYTES for parallel_for_stealing(). Each
+    // piece is encoded into its worst-case slot of the output (one ID per byte), then the
+    // slots are packed in order, so the result does not depend on scheduling.
+    template <class Piece>
+    EncodedBatch encode_pieces(size_t count, Piece&& piece, size_t threads) {
 
-        for (size_t i = 0; i < ids.size(); i++) {
-            segment.push_back(ids[i]);
+        if (!inference_ready) {
+            build_inference_map();
+        }
 
-            if (next_arr[i] == -1) {                    
-                auto encoded = byte_pair_encode_piece(segment);
-                result.insert(result.end(), encoded.begin(), encoded.end());
-                segment.clear();  
+        std::vector<uint64_t> slot_start(count + 1, 0);                // Byte offsets = worst-case ID offsets
+        std::vector<size_t> task_start{0};
+        uint64_t group_bytes = 0;
+        for (size_t i = 0; i < count; i++) {
+            slot_start[i + 1] = slot_start[i] + piece(i).second;
+            group_bytes += piece(i).second + 1;
+            if (group_bytes >= BATCH_TASK_BYTES || i + 1 == count) {
+                task_start.push_back(i + 1);
+                group_bytes = 0;
             }
         }
+        const size_t tasks = task_start.size() - 1;
 
-        return result;
+        EncodedBatch batch;
+        batch.ids.resize(slot_start.back());
+        std::vector<uint64_t> counts(count, 0);
+
+        const size_t workers = std::max<size_t>(1, std::min(threads, tasks));
+        std::vector<EncodeContext> contexts(workers);
+        for (auto& ctx : contexts) ctx.cache.configure(encode_ctx.cache.capacity(), encode_ctx.cache.eviction_policy());
+
+        const BPETokenizer& self = *this;
+        parallel_for_stealing(tasks, workers, [&](size_t w, size_t task) {
+            for (size_t i = task_start[task]; i < task_start[task + 1]; i++) {
+                const auto [data, len] = piece(i);
+                counts[i] = self.encode_into(data, len, contexts[w], batch.ids.data() + slot_start[i], len);
+            }
+        });
+
+        batch.offsets.assign(count + 1, 0);                             // Pack the slots in order
+        for (size_t i = 0; i < count; i++) {
+            if (counts[i] > 0) {                                        // ids.data() may be null when all are empty
+                std::memmove(batch.ids.data() + batch.offsets[i], batch.ids.data() + slot_start[i], counts[i] * sizeof(uint32_t));
+            }
+            batch.offsets[i + 1] = batch.offsets[i] + counts[i];
+        }
+        batch.ids.resize(batch.offsets.back());
+        return batch;
     }
 
     // Decode token IDs back into the original byte sequence.
-    std::string decode(const std::vector<uint32_t>& ids) {
-        std::string s;
-        s.reserve(ids.size()); 
+    // The output size is summed first and allocated once; each token is then copied with
+    // copy_token() (whole 32- or 16-byte blocks, over-reading into the arena padding and
+    // over-writing into TOKEN_PAD bytes of output slack that are trimmed at the end).
+    std::string decode(const std::vector<uint32_t>& ids) const {
+        return decode(ids.data(), ids.size());
+    }
 
-        for (uint32_t id : ids) {
+    std::string decode(const uint32_t* ids, size_t n) const {
+        const char* bytes = vocab.byte_data();                  // One arena for all tokens
+        const uint32_t* offsets = vocab.offset_data();
+        const size_t vocab_size = vocab.size();
+
+        size_t total = 0;
+        for (size_t i = 0; i < n; i++) {
 
     #ifndef NDEBUG
-            assert(id < vocab.size());
+            assert(ids[i] < vocab_size);
     #endif
 
-            if (id < vocab.size()) {
-                s += vocab[id];
-            }
+            if (ids[i] < vocab_size) total += offsets[ids[i] + 1] - offsets[ids[i]];
+        }
+
+        std::string s(total + TOKEN_PAD, '\0');
+        char* out = &s[0];
+        for (size_t i = 0; i < n; i++) {
+            const uint32_t id = ids[i];
+            if (id >= vocab_size) continue;
+            const uint32_t len = offsets[id + 1] - offsets[id];
+            copy_token(out, bytes + offsets[id], len);
+            out += len;
         }
+        s.resize(total);
         return s;
     }
 
 };
 
-// NOTE: Reads entire file into memory; fine for initial implementation.
-// Streaming I/O will be handled at a higher layer (e.g., Python) later.
+// NOTE: Reads entire file into memory. Use for_each_chunk() / train_stream() for
+// corpora that should not be loaded at once.
 std::string read_file(const std::string& path) {
     std::ifstream in(path, std::ios::binary | std::ios::ate);
     if (!in) throw std::runtime_error("Cannot open file");
@@ -569,27 +3120,171 @@ std::string read_file(const std::string& path) {
     return s;
 }
 
+// Peak resident set size of this process, in bytes.
+size_t peak_rss_bytes() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return static_cast<size_t>(ru.ru_maxrss);           // bytes on macOS
+#else
+    return static_cast<size_t>(ru.ru_maxrss) * 1024;    // kilobytes on Linux
+#endif
+}
+
+#ifndef BPE_NO_MAIN
 // main function
 int main(int argc, char** argv) {
     if (argc < 2) return 1;         // Require at least a command name
 
-    std::string cmd = argv[1];      // Command: train | encode | decode
+    std::string cmd = argv[1];      // Command: train | convert | encode | encode-batch | encode-file | decode
     BPETokenizer tok;
     
     if (cmd == "train") {
-        auto text = read_file(argv[2]);                             // Read training corpus
-        uint32_t vs = std::stoi(argv[4]);                           // Vocabulary size
-        uint32_t min_freq = (argc > 5) ? std::stoi(argv[5]) : 2;    // Min merge frequency
-        tok.train(text, vs, min_freq);                              // Learn BPE merges
-        tok.save(argv[3]);                                          // Save tokenizer model
+        // train <corpus> <model> <vocab_size> [min_freq] [--stream] [--chunk-mb N] [--dedup] [--threads N]
+        //       [--indexed-heap] [--swiss] [--stats] [--merge-log <csv>] [--compact-ratio R] [--format 1|2]
+        //       [--word-table N]
+        std::vector<std::string> args;
+        bool stream = false;
+        bool dedup = false;
+        bool stats = false;
+        std::string merge_log;
+        size_t chunk_mb = 64;
+        uint32_t format = BPE_VERSION;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--stream") stream = true;
+            else if (arg == "--dedup") dedup = true;
+            else if (arg == "--threads" && i + 1 < argc) tok.train_threads = std::stoul(argv[++i]);
+            else if (arg == "--indexed-heap") tok.use_indexed_heap = true;
+            else if (arg == "--swiss") tok.train_map_kind = PAIR_MAP_SWISS;
+            else if (arg == "--stats") stats = true;
+            else if (arg == "--merge-log" && i + 1 < argc) merge_log = argv[++i];
+            else if (arg == "--compact-ratio" && i + 1 < argc) tok.index_compact_ratio = std::stod(argv[++i]);
+            else if (arg == "--chunk-mb" && i + 1 < argc) chunk_mb = std::stoul(argv[++i]);
+            else if (arg == "--format" && i + 1 < argc) format = std::stoul(argv[++i]);
+            else if (arg == "--word-table" && i + 1 < argc) tok.word_table_size = std::stoul(argv[++i]);
+            else args.push_back(arg);
+        }
+        if (args.size() < 3) return 1;
+        tok.record_merge_timings = !merge_log.empty();
+
+        uint32_t vs = std::stoi(args[2]);                                   // Vocabulary size
+        uint32_t min_freq = (args.size() > 3) ? std::stoi(args[3]) : 2;     // Min merge frequency
+        if (stream) {
+            tok.train_stream(args[0], vs, min_freq, chunk_mb << 20);        // Chunked read, repeated segments collapsed
+        } else {
+            auto text = read_file(args[0]);                                 // Read training corpus
+            tok.train(text, vs, min_freq, dedup);                           // Learn BPE merges
+        }
+        tok.save(args[1], format);                                          // Save tokenizer model
+        if (stats) {
+            const auto& st = tok.train_stats;
+            std::cerr << "merges: " << st.merges
+                      << "  stale pops: " << st.stale_pops
+                      << "  stale pops avoided: " << st.stale_pops_avoided
+                      << "  queue peak: " << st.queue_peak << "\n"
+                      << "select: " << st.select_seconds * 1e3 << " ms"
+                      << "  snapshot: " << st.snapshot_seconds * 1e3 << " ms"
+                      << "  apply: " << st.apply_seconds * 1e3 << " ms\n"
+                      << "index pool peak: " << st.pool_peak << " nodes"
+                      << "  compactions: " << st.compactions
+                      << "  nodes reclaimed: " << st.nodes_reclaimed
+                      << "  compact: " << st.compact_seconds * 1e3 << " ms"
+                      << "  peak RSS: " << peak_rss_bytes() / (1 << 20) << " MB\n"
+                      << "pair map: " << st.map_capacity << " slots"
+                      << "  resizes: " << st.map_resizes
+                      << "  load: " << st.map_probes.load
+                      << "  avg probe: " << st.map_probes.avg_probe
+                      << "  max probe: " << st.map_probes.max_probe << "\n";
+        }
+        if (!merge_log.empty()) {
+            std::ofstream log(merge_log);
+            log << "rank,count,positions,select_us,snapshot_us,apply_us\n";
+            for (size_t r = 0; r < tok.train_stats.merge_timings.size(); r++) {
+                const auto& mt = tok.train_stats.merge_timings[r];
+                log << r << ',' << mt.count << ',' << mt.positions << ','
+                    << mt.select_seconds * 1e6 << ',' << mt.snapshot_seconds * 1e6 << ','
+                    << mt.apply_seconds * 1e6 << '\n';
+            }
+        }
+        std::cout << "Done.\n";
+    }
+    else if (cmd == "convert") {
+        // convert <model> <output> [--format 1|2]: rewrite a model in another file format
+        if (argc < 4) return 1;
+        uint32_t format = BPE_VERSION_MAPPED;
+        if (argc > 5 && std::string(argv[4]) == "--format") format = std::stoul(argv[5]);
+        tok.load(argv[2]);
+        tok.save(argv[3], format);
         std::cout << "Done.\n";
     }
     else if (cmd == "encode") {
+        // encode <model> <text> [--threads N]
+        if (argc < 4) return 1;
+        size_t threads = 1;
+        if (argc > 5 && std::string(argv[4]) == "--threads") threads = std::stoul(argv[5]);
         tok.load(argv[2]);                                          // Load trained tokenizer
-        auto ids = tok.encode(argv[3]);                             // Encode text into token IDs
+        auto ids = tok.encode_parallel(argv[3], threads);           // Encode text into token IDs
         for(auto id : ids) std::cout << id << " ";
         std::cout << "\n";
     }
+    else if (cmd == "encode-batch") {
+        // encode-batch <model> <docs> [--threads N]: one document per line, one line of IDs per document
+        std::vector<std::string> args;
+        size_t threads = 1;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--threads" && i + 1 < argc) threads = std::stoul(argv[++i]);
+            else args.push_back(arg);
+        }
+        if (args.size() < 2) return 1;
+
+        tok.load(args[0]);
+        const std::string text = read_file(args[1]);
+        std::vector<std::string> docs;
+        for (size_t i = 0; i < text.size();) {
+            size_t j = text.find('\n', i);
+            if (j == std::string::npos) j = text.size();
+            docs.push_back(text.substr(i, j - i));
+            i = j + 1;
+        }
+
+        const EncodedBatch batch = tok.encode_batch(docs, threads);
+        std::string out;
+        for (size_t d = 0; d < docs.size(); d++) {
+            for (uint64_t k = batch.offsets[d]; k < batch.offsets[d + 1]; k++) {
+                out += std::to_string(batch.ids[k]);
+                out += ' ';
+            }
+            out += '\n';
+        }
+        std::cout << out;
+    }
+    else if (cmd == "encode-file") {
+        // encode-file <model> <input> <output> [--u16 | --u32] [--chunk-mb N] [--threads N]
+        std::vector<std::string> args;
+        size_t id_bytes = 0;
+        size_t chunk_mb = 16;
+        size_t threads = 1;
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--u16") id_bytes = 2;
+            else if (arg == "--u32") id_bytes = 4;
+            else if (arg == "--chunk-mb" && i + 1 < argc) chunk_mb = std::stoul(argv[++i]);
+            else if (arg == "--threads" && i + 1 < argc) threads = std::stoul(argv[++i]);
+            else args.push_back(arg);
+        }
+        if (args.size() < 3) return 1;
+
+        tok.load(args[0]);
+        if (id_bytes == 0) id_bytes = tok.vocab.size() <= 65536 ? 2 : 4;   // Narrowest width that fits
+
+        const auto t0 = Clock::now();
+        const auto res = tok.encode_file(args[1], args[2], id_bytes, chunk_mb << 20, threads);
+        const double s = seconds(t0, Clock::now());
+        std::cout << res.bytes << " bytes -> " << res.tokens << " tokens (u" << id_bytes * 8 << ") in "
+                  << s << " s, " << res.bytes / std::max(s, 1e-9) / 1e6 << " MB/s\n";
+    }
     else if (cmd == "decode") {
         tok.load(argv[2]);                                          // Load trained tokenizer
         std::vector<uint32_t> ids;
@@ -598,4 +3293,5 @@ int main(int argc, char** argv) {
         std::cout << tok.decode(ids) << "\n";                       // Decode IDs back to text
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif